@@ -1,95 +1,218 @@
 #include "DomoS.h"
-#include <Serial.h>
-#include <arduino.h>
+#include <Arduino.h>
 #include <EEPROM.h>
+#include <SPI.h>
 
 const byte DomoS::SETUP[DomoS::START] = {
   168, 63};
 
-const char* DomoS::COMMAND[DomoS::NCOMMAND] = {
-  "create",  //Create a new peripheral
-  //syntax: create [name test] [as 42/b00101010]
+/*
+ All the strings are stored in the flash memory (PROGMEM) and never copied into the SRAM,
+ they must be read with the pgm_read_* functions or printed with PrintPhrase and PrintError
+ */
 
-  "turn",    //Sent a signal to a peripheral
+//The keywords of the commands
+static const char CREATEKEYWORD[] PROGMEM = "create";
+static const char TURNKEYWORD[] PROGMEM = "turn";
+static const char DELETEKEYWORD[] PROGMEM = "delete";
+static const char EXITKEYWORD[] PROGMEM = "exit";
+static const char RESETKEYWORD[] PROGMEM = "reset";
+static const char LISTKEYWORD[] PROGMEM = "list";
+static const char STATSKEYWORD[] PROGMEM = "stats";
+static const char COMMITKEYWORD[] PROGMEM = "commit";
+static const char SYNCKEYWORD[] PROGMEM = "sync";
+static const char COMPACTKEYWORD[] PROGMEM = "compact";
+static const char EXPORTKEYWORD[] PROGMEM = "export";
+static const char IMPORTKEYWORD[] PROGMEM = "import";
+static const char NAMEKEYWORD[] PROGMEM = "name";
+static const char ASKEYWORD[] PROGMEM = "as";
+static const char ONKEYWORD[] PROGMEM = "on";
+static const char WIPEKEYWORD[] PROGMEM = "wipe";
+
+//Build a DomoSKeyword from a keyword
+#define KEYWORD(word) { word, sizeof(word) - 1 }
+
+//To add a command add a row here
+const DomoS::DomoSCommand DomoS::COMMAND[DomoS::NCOMMAND] PROGMEM = {
+  { KEYWORD(CREATEKEYWORD), &DomoS::Create },  //Create a new peripheral
+  //syntax: create [name test] [as 42/b00101010] [on 1]
+
+  { KEYWORD(TURNKEYWORD), &DomoS::Turn },    //Sent a signal to a peripheral
   //syntax: turn name high/low/%10/v2.3
+  //syntax: turn #42,name high
 
-  "delete",  //Delete a peripheral
+  { KEYWORD(DELETEKEYWORD), &DomoS::Delete },  //Delete a peripheral
   //syntax: delete name
 
-  "exit",    //Turn off the DomoS Module
+  { KEYWORD(EXITKEYWORD), &DomoS::Exit },    //Turn off the DomoS Module
   //syntax: exit
 
-  "name", 	//Define the name of the new peripheral
+  { KEYWORD(RESETKEYWORD), &DomoS::Reset },      //Reset the DomoS module deletting the first two cells of EEPROM
+  //syntax: reset [wipe]
+  //wipe clears also all the storage, going on when idle and printing the progress
+
+  { KEYWORD(LISTKEYWORD), &DomoS::List },        //Give a list of all the installed peripheral
+
+  { KEYWORD(STATSKEYWORD), &DomoS::Stats },       //Give the time and the storage accesses of the previous command
+  //syntax: stats
+  //answer: stats command=turn us=1234 reads=10 writes=0 totalreads=2000 totalwrites=120 peripherals=20 capacity=126 bootus=900 bootreads=20 warmboot=1
+
+  { KEYWORD(COMMITKEYWORD), &DomoS::Commit },     //Write into the storage all the changes still in memory
+  //syntax: commit
+
+  { KEYWORD(SYNCKEYWORD), &DomoS::Commit },       //Same as commit
+  //syntax: sync
+
+  { KEYWORD(COMPACTKEYWORD), &DomoS::Compact },   //Sort the peripherals by number and remove the free slots
+  //syntax: compact
+
+  { KEYWORD(EXPORTKEYWORD), &DomoS::Export },     //Print all the peripherals as import commands, ended by commit
+  //syntax: export
+  //answer: import 05a4d84000000001134b9c0000000002f1
+  //answer: commit
+
+  { KEYWORD(IMPORTKEYWORD), &DomoS::Import }      //Create the peripherals of a line printed by export
+  //syntax: import <up to 3 stored records, 16 hex digit each><CRC of the records, 2 hex digit>
+  //Send the next line only after the answer, the serial buffer is small
+};
+
+//The order must be the same of NAMESUBCOMMAND, ASSUBCOMMAND and ONSUBCOMMAND
+const DomoS::DomoSKeyword DomoS::SUBCOMMAND[DomoS::NSUBCOMMAND] PROGMEM = {
+  KEYWORD(NAMEKEYWORD), 	//Define the name of the new peripheral
   //Max 9 character
   //Can be blank
 
-  "as",	  	//Define the custom number/addressment of the new peripheral
+  KEYWORD(ASKEYWORD),	  	//Define the custom number/addressment of the new peripheral
   //Can be blank
   //Accept both decimal number and binary number
 
-  "reset",      //Reset the DomoS module deletting the first two cells of EEPROM
-
-  "list"        //Give a list of all the installed peripheral
+  KEYWORD(ONKEYWORD)	  	//Define the output channel of the new peripheral
+  //Can be blank, channel 0
 };
 
-const char* DomoS::PHRASE[DomoS::NPHRASE] = {
-  "Write the number of address pins (max 8): ", //0
-  "Write the address pin: ", //1
-  "Do you want to store peripherals data into EEPROM? (-1 for yes or the CSpin): ", //2
-  "Error! Reinsert the asked data: ", //3
-  "Pin already used! Select another: ", //4
-  "Digital pin 6 will automatically used for output, don't select them!", //5
-  "Peripheral N whit number M (addressing B) created succesfully!", //6
-  "Welcome to DomoS", //7
-  "Resetting complete, now reset your arduino", //8
-  "Buy buy from me and my creator ;)", //9
-  "Peripheral N whit number M (addressing B)", //10
-  "Peripheral deletted succesfully" //11
+const DomoS::DomoSKeyword DomoS::WIPEOPTION PROGMEM = KEYWORD(WIPEKEYWORD);
+
+#undef KEYWORD
+
+//The output pins of the channels, the i-th channel uses the i-th pin
+static const byte CHANNELPIN[] PROGMEM = { 6, 5, 3, 9 };
+
+//The character allowed in a peripheral name, from version 2 a name is stored as the positions
+//of its character in this string plus one, 0 is the end of the name
+static const char NAMECHARSET[] PROGMEM = "abcdefghijklmnopqrstuvwxyz0123456789_-.:;+*/#@!?()[]<>=&$^~'|{}";
+
+static const char PHRASE0[] PROGMEM = "Write the number of address pins (max 8): ";
+static const char PHRASE1[] PROGMEM = "Write the address pin: ";
+static const char PHRASE2[] PROGMEM = "Do you want to store peripherals data into EEPROM? (-1 for yes or the CSpin): ";
+static const char PHRASE3[] PROGMEM = "Error! Reinsert the asked data: ";
+static const char PHRASE4[] PROGMEM = "Pin already used! Select another: ";
+static const char PHRASE5[] PROGMEM = "Digital pins 6, 5, 3, 9 will automatically used for the output channels 0, 1, 2, 3, don't select them!";
+static const char PHRASE6[] PROGMEM = "Peripheral N whit number M (addressing B) on channel C created succesfully!";
+static const char PHRASE7[] PROGMEM = "Welcome to DomoS";
+static const char PHRASE8[] PROGMEM = "Resetting complete, now reset your arduino";
+static const char PHRASE9[] PROGMEM = "Buy buy from me and my creator ;)";
+static const char PHRASE10[] PROGMEM = "Peripheral N whit number M (addressing B) on channel C";
+static const char PHRASE11[] PROGMEM = "Peripheral deletted succesfully";
+static const char PHRASE12[] PROGMEM = "Peripherals sorted and compacted";
+static const char PHRASE13[] PROGMEM = "Do you want to address the peripherals by shift registers? (0 for no or the latch pin): ";
+static const char PHRASE14[] PROGMEM = "Write the number of output channels (max 4): ";
+static const char PHRASE15[] PROGMEM = "The configuration is damaged, insert it again";
+static const char PHRASE16[] PROGMEM = "Wiping the storage: ";
+static const char PHRASE17[] PROGMEM = "Peripherals imported";
+static const char PHRASE18[] PROGMEM = "Name already used, the peripheral takes its number as name: ";
+
+const char* const DomoS::PHRASE[DomoS::NPHRASE] PROGMEM = {
+  PHRASE0, PHRASE1, PHRASE2, PHRASE3, PHRASE4, PHRASE5,
+  PHRASE6, PHRASE7, PHRASE8, PHRASE9, PHRASE10, PHRASE11,
+  PHRASE12, PHRASE13, PHRASE14, PHRASE15, PHRASE16, PHRASE17,
+  PHRASE18
 };
 
-const char* DomoS::ERROR[DomoS::NERROR] = {
-  "YESH, no error :)",
-  "The command string you entered exeded 64 character,.",
-  "One of your sub command is too long.",
-  "Your main command wasn't recognized.",
-  "There are no command in your string.",
-  "One of the sub command wasn't recognized.",
-  "The name of the peripheral wasn't defined.",
-  "The name you entered is too long.",
-  "The address wasn't defined.",
-  "The binary number you entered is too long.",
-  "The EEPROM is full.",
-  "The peripheral you entered wasn't found.",
-  "Turn parameters wasn't recognized.",
-  "Random errors sometimes occurs.",
-  "The peripheral with number zero is not allowed.",
-  "The maximum number of allowed peripheral was reach.",
-  "The name you entered is not unique.",
-  "The number you entered is not unique.",
-  "Can't find a free standard name.",
-  "Can't find free address",
-  "The voltage you entered is too low.",
-  "he voltage you entered is too high.",
-  "The number you entered is too big.",
-  "There are no peripheral to be showed"
+static const char HEXDIGIT[] PROGMEM = "0123456789abcdef";
+
+static const char ERROR0[] PROGMEM = "YESH, no error :)";
+static const char ERROR1[] PROGMEM = "The command string you entered exeded 64 character,.";
+static const char ERROR2[] PROGMEM = "One of your sub command is too long.";
+static const char ERROR3[] PROGMEM = "Your main command wasn't recognized.";
+static const char ERROR4[] PROGMEM = "There are no command in your string.";
+static const char ERROR5[] PROGMEM = "One of the sub command wasn't recognized.";
+static const char ERROR6[] PROGMEM = "The name of the peripheral wasn't defined.";
+static const char ERROR7[] PROGMEM = "The name you entered is too long.";
+static const char ERROR8[] PROGMEM = "The address wasn't defined.";
+static const char ERROR9[] PROGMEM = "The binary number you entered is too long.";
+static const char ERROR10[] PROGMEM = "The EEPROM is full.";
+static const char ERROR11[] PROGMEM = "The peripheral you entered wasn't found.";
+static const char ERROR12[] PROGMEM = "Turn parameters wasn't recognized.";
+static const char ERROR13[] PROGMEM = "Random errors sometimes occurs.";
+static const char ERROR14[] PROGMEM = "The peripheral with number zero is not allowed.";
+static const char ERROR15[] PROGMEM = "The maximum number of allowed peripheral was reach.";
+static const char ERROR16[] PROGMEM = "The name you entered is not unique.";
+static const char ERROR17[] PROGMEM = "The number you entered is not unique.";
+static const char ERROR18[] PROGMEM = "Can't find a free standard name.";
+static const char ERROR19[] PROGMEM = "Can't find free address";
+static const char ERROR20[] PROGMEM = "The voltage you entered is too low.";
+static const char ERROR21[] PROGMEM = "he voltage you entered is too high.";
+static const char ERROR22[] PROGMEM = "The number you entered is too big.";
+static const char ERROR23[] PROGMEM = "There are no peripheral to be showed";
+static const char ERROR24[] PROGMEM = "Too many peripheral are waiting to be turned.";
+static const char ERROR25[] PROGMEM = "Too many peripheral in a single turn command.";
+static const char ERROR26[] PROGMEM = "The name you entered contains a character not allowed.";
+static const char ERROR27[] PROGMEM = "The SD card can't be used, the peripherals are stored in the EEPROM.";
+static const char ERROR28[] PROGMEM = "The channel you entered doesn't exist.";
+static const char ERROR29[] PROGMEM = "The storage is being wiped, wait the end and reset your arduino.";
+static const char ERROR30[] PROGMEM = "The import line is damaged, send it again.";
+static const char ERROR31[] PROGMEM = "The binary frame is damaged or its fields aren't valid.";
+static const char ERROR32[] PROGMEM = "An address pin isn't on a port, it can't be used.";
+
+const char* const DomoS::ERROR[DomoS::NERROR] PROGMEM = {
+  ERROR0, ERROR1, ERROR2, ERROR3, ERROR4, ERROR5,
+  ERROR6, ERROR7, ERROR8, ERROR9, ERROR10, ERROR11,
+  ERROR12, ERROR13, ERROR14, ERROR15, ERROR16, ERROR17,
+  ERROR18, ERROR19, ERROR20, ERROR21, ERROR22, ERROR23,
+  ERROR24, ERROR25, ERROR26, ERROR27,
+  ERROR28, ERROR29, ERROR30, ERROR31,
+  ERROR32
 };
 
+//Not cleared by a reset, on a computer the snapshot has its own section and the host shim
+//fills it whit garbage when the board is powered on
+#if defined(__AVR__)
+DomoS::DomoSSnapshot DomoS::_snapshot __attribute__((section(".noinit")));
+#else
+DomoS::DomoSSnapshot DomoS::_snapshot __attribute__((section("domos_noinit")));
+#endif
+
 DomoS::DomoS()
 /*	Standard costructor for the DomoS Module
  	At first, check if DomoS was already setup using the CheckSetupData
  	If is the first start call the FirstStart function then initialize the module whit Initialize,
  	else go directly to Initialize
+ 	The time spent by Initialize is shown by the stats command
  	
  	Debugged: Don't need to eb debugged
  */
 {
-  Serial.begin(9600);
+  unsigned long start;
+
+  _storageReads = 0; //Start counting the storage accesses
+  _storageWrites = 0;
+  _queuedWrites = 0;
+  _numDirty = 0; //No cell is waiting to be written
+  _storage = &_eeprom; //Until the configuration is read only the EEPROM can be used
+  _storageOpen = false;
+  _numberMap = false;
+
+  Serial.begin(BAUDRATE);
   if (!CheckSetupData())
     FirstStart();
 
+  start = micros();
+  _bootReads = _storageReads; //The first start isn't counted
   Initialize();
+  _bootTime = micros() - start;
+  _bootReads = _storageReads - _bootReads;
 
-  Serial.println(PHRASE[7]);
+  PrintPhrase(7);
   return;
 }
 
@@ -101,7 +224,7 @@ boolean DomoS::CheckSetupData()
 {
   boolean ok;
 
-  if ((EEPROM.read(0) == SETUP[0]) && (EEPROM.read(1) == SETUP[1]))
+  if ((ReadStorage(0) == SETUP[0]) && (ReadStorage(1) == SETUP[1]))
     ok = true;
   else
     ok = false;
@@ -111,59 +234,281 @@ boolean DomoS::CheckSetupData()
 
 void DomoS::Initialize()
 /*	Initialize all the DomoS' components
- 	At first read all the configuration parameters from the EEPROM using
- 	GetConfigurationDataFromEeprom, then initialize all the DomoS variables at a known state
+ 	At first read all the configuration parameters from the snapshot, or if it isn't valid from
+ 	the EEPROM using GetConfigurationDataFromEeprom and build the indexes reading the table,
+ 	then initialize all the DomoS variables at a known state
  	
  	Debugged: Don't need to be debugged
  */
 {
-  GetConfigurationDataFromEeprom();
+  DomoSFileHeader data;
+
   _lastError = OK; 		//Set the last error at no error (OK)
+  _warmBoot = LoadSnapshot(); //After a reset the snapshot has everything
+  if (!_warmBoot)
+  {
+    if (!GetConfigurationDataFromEeprom()) //Ask again the configuration, but keep the peripherals
+    {
+      PrintPhrase(15);
+      AskData(data);
+      WriteConfigurationDataToEeprom(data);
+      CommitStorage();
+      GetConfigurationDataFromEeprom();
+    }
+    OpenStorage(); 			//Choose where the peripherals are stored
+    if (_fileVer < FILEVER) 	//Bring an old file to the current version
+      MigrateFile();
+    BuildIndex(); 			//Count the peripherals and load their names and numbers
+  }
+  else
+    OpenStorage();
   _command[0] = '\0'; 	//Set the command string at empty string
-  _subCommand[0] = '\0'; 	//Set the subcommand string at empty string
+  _commandLen = 0;
+  _discardLine = false;
+  _inFrame = false; 		//No binary frame being read
+  _commandReply = NOREPLY; 	//No command being executed
+  _numToken = 0; 			//Set the command words at no words
+  _nextToken = 0;
+  _lastCommand = NCOMMAND; 	//Set the statistics at no command executed
+  _lastCommandTime = 0;
+  _lastCommandReads = 0;
+  _lastCommandWrites = 0;
   _on = true;				//Set the on parameter at true
-
+  _firstActuation = 0; 	//Set the actuation queue at empty queue
+  _numActuation = 0;
+  _currentTarget = 0;
+  _settling = false;
+  _addressedChannel = NOCHANNEL;
+  _compacting = false; 	//No compaction in progress
+  _wiping = false; 		//No wipe in progress
+
+  if (_shiftRegister) //Only the latch pin, the other lines are the SPI ones
+  {
+    pinMode(_addressPin[0], OUTPUT);
+    digitalWrite(_addressPin[0], HIGH);
+    SPI.begin();
+  }
+  else
+  {
     for(byte i = 0; i<_numAddressPin; i++)
-    pinMode(_addressPin[i], OUTPUT);
+      pinMode(_addressPin[i], OUTPUT);
+
+    BuildAddressPorts(); //Find the port registers of the addressing pins
+  }
+
+  for (byte i = 0; i < _numChannel; i++) //All the channels start discharged
+  {
+    _channelPin[i] = pgm_read_byte(&CHANNELPIN[i]);
+    _channelValue[i] = 0;
+    _channelTime[i] = millis();
+    pinMode(_channelPin[i], OUTPUT);
+  }
 
-  pinMode(_outputPin, OUTPUT);
+  return;
+}
+
+void DomoS::OpenStorage()
+/*	Choose the storage of the peripherals: the EEPROM, or the DomoS.dat file if a CS pin was set
+ 	If the file can't be used set an error and go on with the EEPROM
+ 	The header of the file is always in the EEPROM, because there's the CS pin
+ */
+{
+  int numSlot;
+
+  if (!_storageOpen)
+  {
+    _storage = &_eeprom;
+
+    if (_writeToEeprom != (byte)-1) //Check if a CSPin was set
+    {
+#if defined(DOMOS_USE_FILE)
+      if (_file.Begin(_writeToEeprom))
+        _storage = &_file;
+      else
+#endif
+        _lastError = STORAGENOTAVAILABLE;
+    }
+
+    //The slots that fit in the storage, the address space can't handle more than MAXPERIPHERAL
+    numSlot = (((_storage == &_eeprom) ? E2END : _storage->Size()) - PeripheralAddress(0)) / sizeof(DomoSFileRecord);
+    _maxSlot = (numSlot < MAXPERIPHERAL) ? numSlot : MAXPERIPHERAL;
 
-  /*if(_writeToEeprom != -1)
-   pinMode(_writeToEeprom, OUTPUT);*/
+    //The number map is used only if it fits after the biggest possible table, so it never takes
+    //the place of a slot
+    _numberMap = (_storage->Size() >= (NumberMapAddress(0) + NUMBERMAPSIZE));
+
+    _storageOpen = true;
+  }
 
   return;
 }
 
-void DomoS::GetConfigurationDataFromEeprom()
+boolean DomoS::GetConfigurationDataFromEeprom()
 /*	Get all the configuration parameters from the internal arduino EEPROM
- 	Starting from START address start reading all the parameters following a specific sequence
+ 	The header is read with a single block read starting from START address, the fields of
+ 	DomoSFileHeader are in the same order of the EEPROM cells
  	if someone modify this sequence go to modify also WriteConfigurationDataToEeprom()
+ 	From version 4 check the CRC of the header and that the values are allowed
+ 	For every version check that the addressing pins are on a port, see BuildAddressPorts
+ 	A damaged version cell would make the file look older and MigrateFile would destroy it, so
+ 	if the header can't be the one of an older file, and whit the current version it matches the
+ 	CRC, only the version is restored; the CRC is a single byte and the older files haven't it, so
+ 	a header that can be older is always taken as older
+ 	Return false if the header is damaged
  	
  	Debugged: OK
  */
 {
-  byte i; 
+  DomoSFileHeader data;
+  boolean ok;
+  byte fileVer; //The version read
+  byte i;
 
-  i = START;
+  ReadStorage(START, (byte*)&data, sizeof(data));
 
-  //Start reading all data
-  //After each reading increment i
-  _fileVer = EEPROM.read(i); 
-  i++;
-  _numPeripheral = EEPROM.read(i); 
-  i++;
-  _numAddressPin = EEPROM.read(i); 
-  i++;
+  if ((data.fileVer != FILEVER) && (data.numChannel > 0) && (data.numChannel <= MAXCHANNEL)
+    && (!IsOldHeader(data)))
+  {
+    fileVer = data.fileVer;
+    data.fileVer = FILEVER;
+    if (ReadStorage(HEADERCRC) == Crc8((byte*)&data, sizeof(data)))
+      WriteStorage(START, FILEVER); //The version is the first cell of the header
+    else
+      data.fileVer = fileVer; //A damaged header
+  }
 
-  //Cycle for avoid a sequence of 8 single reading
-  //After the cycle increment i
-  //Here are been used two index, j for the _adressPin and i for reading
-  for(byte j = 0; j<MAXADDRESSPIN; j++, i++)
-    _addressPin[j] = EEPROM.read(i);
+  ok = true; //The older versions haven't the CRC
+  if (data.fileVer >= 4)
+    ok = (data.fileVer <= FILEVER) && (ReadStorage(HEADERCRC) == Crc8((byte*)&data, sizeof(data)))
+      && ((data.numAddressPin & ~SHIFTREGISTER) <= MAXADDRESSPIN)
+      && (data.numChannel > 0) && (data.numChannel <= MAXCHANNEL);
 
-  _outputPin = EEPROM.read(i); 
-  i++;
-  _writeToEeprom = EEPROM.read(i);
+  if (!(data.numAddressPin & SHIFTREGISTER)) //The latch pin is written by digitalWrite, that checks it
+    for (i = 0; (i < data.numAddressPin) && (i < MAXADDRESSPIN) && (ok); i++)
+      ok = (digitalPinToPort(data.addressPin[i]) != NOT_A_PORT);
+
+  _fileVer = data.fileVer;
+  _numPeripheral = data.numChannel; //Only version 0 stored here the number of peripherals
+  _numChannel = ((_fileVer >= 3) && (data.numChannel > 0) && (data.numChannel <= MAXCHANNEL)) ? data.numChannel : 1;
+  _shiftRegister = ((data.numAddressPin & SHIFTREGISTER) != 0);
+  _numAddressPin = data.numAddressPin & ~SHIFTREGISTER;
+  memcpy(_addressPin, data.addressPin, MAXADDRESSPIN);
+  _writeToEeprom = data.writeToEeprom;
+
+  return ok;
+}
+
+boolean DomoS::IsOldHeader(const DomoSFileHeader & data)
+/*	Tell if data can be the header of a file of an older version
+ 	Version 0 and 1 have in the cell of the number of channels the number of peripherals, and
+ 	at least so many 11 byte slots from the start of the table have a name made of printable
+ 	characters: version 0 keeps them there, and version 1 only clears the number of a deleted one
+ 	Version 2 and 3 have the slots of the current version, their migration changes only the header
+ */
+{
+  DomoSFileBody body;
+  boolean ok;
+  byte i, j;
+
+  if (data.fileVer < 2)
+  {
+    ok = (data.numChannel <= OLDMAXPERIPHERAL);
+
+    for (i = 0; ok && (i < data.numChannel); i++)
+    {
+      ReadStorage(PeripheralAddress(0) + (OLDRECORDSIZE * i), (byte*)&body, OLDRECORDSIZE);
+
+      for (j = 0; (j < MAXNAMELEN) && (isgraph((byte)body.name[j])); j++);
+      ok = (j > 0) && (j < MAXNAMELEN) && (body.name[j] == '\0');
+    }
+  }
+  else
+    ok = (data.fileVer < FILEVER);
+
+  return ok;
+}
+
+void DomoS::UpdateHeaderCrc()
+/*	Write in HEADERCRC the CRC of the header stored in the EEPROM
+ */
+{
+  DomoSFileHeader data;
+
+  ReadStorage(START, (byte*)&data, sizeof(data));
+  WriteStorage(HEADERCRC, Crc8((byte*)&data, sizeof(data)));
+
+  return;
+}
+
+byte DomoS::Crc8(const byte data[], int length)
+/*	Compute the CRC-8 (polynomial x^8 + x^2 + x + 1) of length bytes
+ */
+{
+  byte crc;
+  byte i;
+
+  crc = 0;
+  for (; length > 0; length--, data++)
+  {
+    crc ^= *data;
+    for (i = 0; i < 8; i++)
+      crc = (crc & 0x80) ? ((crc << 1) ^ 0x07) : (crc << 1);
+  }
+
+  return crc;
+}
+
+boolean DomoS::LoadSnapshot()
+/*	Get the configuration and the indexes from the snapshot left in RAM before a reset
+ 	The snapshot is used only if it was saved, its CRC is right and the header in the EEPROM is
+ 	still the same, this costs only the reading of the header instead of all the table
+ */
+{
+  DomoSFileHeader data;
+  boolean ok;
+
+  ok = (_snapshot.check == SNAPSHOTCHECK)
+    && (_snapshot.crc == Crc8(&_snapshot.crc + 1, sizeof(_snapshot) - ((&_snapshot.crc + 1) - (byte*)&_snapshot)))
+    && (_snapshot.header.fileVer == FILEVER);
+
+  if (ok) //The EEPROM could be changed by another sketch, the header must be the same
+  {
+    ReadStorage(START, (byte*)&data, sizeof(data));
+    ok = (memcmp(&data, &_snapshot.header, sizeof(data)) == 0);
+  }
+
+  if (ok)
+  {
+    _fileVer = _snapshot.header.fileVer;
+    _numChannel = _snapshot.header.numChannel;
+    _shiftRegister = ((_snapshot.header.numAddressPin & SHIFTREGISTER) != 0);
+    _numAddressPin = _snapshot.header.numAddressPin & ~SHIFTREGISTER;
+    memcpy(_addressPin, _snapshot.header.addressPin, MAXADDRESSPIN);
+    _writeToEeprom = _snapshot.header.writeToEeprom;
+
+    _numPeripheral = _snapshot.numPeripheral;
+    _numSlot = _snapshot.numSlot;
+    _numSorted = _snapshot.numSorted;
+  }
+  else
+    _snapshot.check = 0; //Don't use it until it's saved again
+
+  return ok;
+}
+
+void DomoS::SaveSnapshot()
+/*	Save the configuration and the indexes in the snapshot
+ 	Called only when nothing is waiting to be written, so the snapshot is the same of the storage
+ 	The indexes are already in the snapshot, they're always used from there
+ */
+{
+  ReadStorage(START, (byte*)&_snapshot.header, sizeof(_snapshot.header));
+  _snapshot.numPeripheral = _numPeripheral;
+  _snapshot.numSlot = _numSlot;
+  _snapshot.numSorted = _numSorted;
+
+  _snapshot.crc = Crc8(&_snapshot.crc + 1, sizeof(_snapshot) - ((&_snapshot.crc + 1) - (byte*)&_snapshot));
+  _snapshot.check = SNAPSHOTCHECK;
 
   return;
 }
@@ -177,7 +522,9 @@ void DomoS::FirstStart()
  */
 {
   DomoSFileHeader data;
+  byte i;
 
+  _snapshot.check = 0; //The snapshot is of the previous installation
   ClearEeprom();
 
   AskData(data);
@@ -186,6 +533,20 @@ void DomoS::FirstStart()
 
   WriteSetupData();
 
+  CommitStorage(); //Don't leave the setup in memory
+
+  if (data.writeToEeprom != (byte)-1) //The DomoS.dat file can contain an old installation, clear it
+  {
+    _writeToEeprom = data.writeToEeprom;
+    OpenStorage();
+    if (_storage != &_eeprom)
+    {
+      for (i = 0; i < _maxSlot; i++)
+        ErasePeripheral(i);
+      CommitStorage();
+    }
+  }
+
   return;
 }
 
@@ -195,25 +556,30 @@ void DomoS::WriteSetupData()
  	Debugged: OK
  */
 { 
-  EEPROM.write(0, SETUP[0]);
-  EEPROM.write(1, SETUP[1]);
+  WriteStorage(0, SETUP[0]);
+  WriteStorage(1, SETUP[1]);
 
   return;
 }
 
 void DomoS::ClearEeprom()
-/*	Clear all the EEPROM setting at 0 all the EEPROM cells
- 	E2END constant contain the number of the last EEPROM cell
+/*	Clear the EEPROM cells used by DomoS, an old installation can be still there
+ 	Only the header, its CRC and the number of every slot are cleared: a slot whit number 0 is
+ 	free and its name is never read, and the number map is fixed by BuildIndex at every start
+ 	So at most a cell for every slot is written, instead of all the EEPROM
+ 	For clearing all the cells use reset wipe
  	
  	Debugged: OK
  */
 {
   int i;
 
-  //Cycle for all the EEPROM cells and set to 0
-  for(i = 0; i <= E2END; i++)
-    if(EEPROM.read(i) != 0)
-      EEPROM.write(i, 0);
+  for (i = START; i < PeripheralAddress(0); i++)
+    WriteStorage(i, 0);
+  WriteStorage(HEADERCRC, 0);
+
+  for (i = 0; i < ((EEPROMPERIPHERAL < MAXPERIPHERAL) ? EEPROMPERIPHERAL : MAXPERIPHERAL); i++)
+    WriteStorage(PeripheralAddress(i) + PACKEDNAMELEN, 0);
 
   return;
 }
@@ -230,15 +596,48 @@ void DomoS::AskData(DomoSFileHeader & data)
   byte val;	//The value read by parseInt
   byte i, j;
   boolean ok;	//Tell if the values readed are correctly
+  boolean shiftRegister; //Tell if the addressing is done by shift registers
+
+  Serial.begin(BAUDRATE); //Start the serial communication
+
+  //Read the number of output channels
+  PrintPhrase(14);
+
+  val = (byte)parseInt();
 
-  Serial.begin(9600); //Start the serial communication
+  while((val == 0) || (val > MAXCHANNEL))
+  {
+    PrintPhrase(3);
+
+    val = (byte)parseInt();
+  }
+
+  data.numChannel = val;
+  data.outputPin = pgm_read_byte(&CHANNELPIN[0]);
+
+  //Allarm the user about the output pins
+  PrintPhrase(5);
+
+  //Read the addressing mode, 0 for the addressing pins or the latch pin of the shift registers
+  PrintPhrase(13);
+
+  val = (byte)parseInt();
+
+  //The latch pin can't be an output pin or a SPI pin, and it must be on a port
+  while((IsChannelPin(val, data.numChannel)) || (val == MOSI) || (val == SCK) || (val == MISO)
+    || ((val != 0) && (digitalPinToPort(val) == NOT_A_PORT)))
+  {
+    PrintPhrase(3);
+
+    val = (byte)parseInt();
+  }
 
-  //Allarm the user about pin 6
-  Serial.println(PHRASE[5]);
-  data.outputPin = 6;
+  shiftRegister = (val != 0);
+  data.addressPin[0] = val;
+  //End reading of addressing mode
 
   //Read variable value for numAddressPin
-  Serial.println(PHRASE[0]); //Maybe i should create a custom function for writing phrases
+  PrintPhrase(0);
 
   val = (byte)parseInt(); //Read the value
 
@@ -246,7 +645,7 @@ void DomoS::AskData(DomoSFileHeader & data)
   //Cycle until a correct value is read
   while(val > MAXADDRESSPIN)
   {
-    Serial.println(PHRASE[3]);
+    PrintPhrase(3);
 
     val = (byte)parseInt();
   }
@@ -257,10 +656,11 @@ void DomoS::AskData(DomoSFileHeader & data)
   //Read variable values for array addressPin
 
   //Cycle until read all the addressPin was read
-  i = 0;
-  while(i < data.numAddressPin)
+  //With the shift registers there's only the latch pin, already read
+  i = (shiftRegister ? 1 : 0);
+  while((!shiftRegister) && (i < data.numAddressPin))
   {
-    Serial.println(PHRASE[1]);
+    PrintPhrase(1);
 
     do //Read the value and search for duplicates
     {
@@ -270,8 +670,9 @@ void DomoS::AskData(DomoSFileHeader & data)
 
       //Check if this value is different from the previous
       //Cycle until checked all the previous values or found an identical value
+      //A pin without a port can't be written by SetAddressing
       j = 0;
-      if(val != data.outputPin)
+      if((!IsChannelPin(val, data.numChannel)) && (digitalPinToPort(val) != NOT_A_PORT))
       {
         while ((j < i) && (ok))
         {
@@ -285,7 +686,7 @@ void DomoS::AskData(DomoSFileHeader & data)
         ok = false;
 
       if (!ok)
-        Serial.println(PHRASE[3]);
+        PrintPhrase(3);
 
 
     }
@@ -299,10 +700,13 @@ void DomoS::AskData(DomoSFileHeader & data)
   for(i = i; i < MAXADDRESSPIN; i++)
     data.addressPin[i] = -1;
 
+  if (shiftRegister)
+    data.numAddressPin |= SHIFTREGISTER;
+
   //End reading of array addressPin
 
   //Read variable value for writeToEeprom
-  Serial.println(PHRASE[2]);
+  PrintPhrase(2);
 
   val = (byte)parseInt();
 
@@ -310,7 +714,6 @@ void DomoS::AskData(DomoSFileHeader & data)
   //End reading for writeToEeprom
 
   data.fileVer = FILEVER; //Set fileVer to the internal file version
-  data.numPeripheral = 0; //Set the number of peripheral to 0
 
     return;
 }
@@ -339,6 +742,17 @@ int DomoS::parseInt()
   return val;
 }
 
+boolean DomoS::IsChannelPin(byte pin, byte numChannel)
+/*	Tell if pin is the output pin of one of the first numChannel channels
+ */
+{
+  byte i;
+
+  for (i = 0; (i < numChannel) && (pgm_read_byte(&CHANNELPIN[i]) != pin); i++);
+
+  return (i < numChannel);
+}
+
 void DomoS::WriteConfigurationDataToEeprom (DomoSFileHeader data)
 /*	Write the configuration parameters contain in data
  	Starting from START address start writing all the parameters following a specific sequence
@@ -353,168 +767,172 @@ void DomoS::WriteConfigurationDataToEeprom (DomoSFileHeader data)
 
   //Start writing all data
   //After each writing increment i
-  EEPROM.write(i, data.fileVer); 
+  WriteStorage(i, data.fileVer); 
   i++;
-  EEPROM.write(i, data.numPeripheral); 
+  WriteStorage(i, data.numChannel); 
   i++;
-  EEPROM.write(i, data.numAddressPin); 
+  WriteStorage(i, data.numAddressPin); 
   i++;
 
   //Cycle for avoid a sequence of 8 single writing
   //After the cycle increment i
   //Here are been used two index, j for the _addressPin and i for writing
   for(byte j = 0; j < MAXADDRESSPIN; i++, j++)
-    EEPROM.write(i, data.addressPin[j]);
+    WriteStorage(i, data.addressPin[j]);
 
-  EEPROM.write(i, data.outputPin); 
+  WriteStorage(i, data.outputPin); 
   i++;
-  EEPROM.write(i, data.writeToEeprom);
+  WriteStorage(i, data.writeToEeprom);
+
+  UpdateHeaderCrc();
 
   return;
 }
 
-boolean DomoS::ConvertDecimalToBinary(int number, boolean result[])
-/*	Convert a decimal number into an array of boolean value, false for 0, true for 1
- 	Return false if the number is too big for the conversion, true if the conversion goes right
+void DomoS::SetAddressing(byte address)
+/*	Set the addressing pin to the bits of address
+ 	The number of a peripheral is already its address: the first addressing pin is the most
+ 	significant bit, the last one the least significant bit, so no conversion is needed
+ 	Every port is written once with all its addressing lines, with the interrupts disabled
+ 	so an interrupt changing the same port can't be lost, and the peripherals never see
+ 	an address made of the old and the new lines
+ 	With the shift registers the address is sent by SPI, then all the lines change together
+ 	when the latch pin goes up
  	
  	Debugged: OK
- 	Corrected a typo on the first if [<= -> >=]
- 	Solved a problem on the first if, div should be divided by 2
  */
 {
-  int part;
-  int div;
-  int i;
-  boolean ok;
+  byte i;
+  byte bit; //The bit of address for the i-th addressing pin
+  byte value[MAXADDRESSPIN]; //The addressing lines to be set on every port
+  byte oldSREG;
 
-  ok = true; //Assume the conversion goes right
-  div = 1 << _numAddressPin; //Equal to 2 ^ _numAddressPin
-  if ((div - 1) >= number) //Check if the number is too big
+  if (_shiftRegister)
   {
-    div = div/2;
-    i = 0;
-    part = number;
-
-    while (i < _numAddressPin)
-    {
-      if (part / div == 1)
-      {
-        result[i] = true;
-        part = part % div;
-      }
-      else
-        result[i] = false;
-
-      i++;
-      div = div / 2;
-    }
+    SPI.beginTransaction(SPISettings(SHIFTCLOCK, MSBFIRST, SPI_MODE0));
+    digitalWrite(_addressPin[0], LOW);
+    SPI.transfer(address); //The n-th output of the shift register is the n-th bit of address
+    digitalWrite(_addressPin[0], HIGH);
+    SPI.endTransaction();
   }
   else
-    ok = false;
+  {
+    memset(value, 0, _numAddressPort);
 
-  return ok;
-}
+    bit = 1 << (_numAddressPin - 1);
 
-void DomoS::SetAddressing(boolean addressing[])
-/*	Set the addressing pin to the values contained in addressing array
- 	
- 	Debugged: OK
- */
-{
-  byte i;
+    //Cycle for all the addressing pin, putting the bit of address in its port
+    for (i = 0; i < _numAddressPin; i++, bit >>= 1)
+      if (address & bit)
+        value[_addressPinPort[i]] |= _addressPinMask[i];
 
-  //Cycle for all the addressing pin
-  for (i = 0; i < _numAddressPin; i++)
-    //Set the addressing pin to HIGH or LOW depending on addressing values
-    digitalWrite(_addressPin[i], (addressing[i] ? HIGH : LOW));
+    oldSREG = SREG;
+    cli();
+    for (i = 0; i < _numAddressPort; i++)
+      *_addressPort[i].output = (*_addressPort[i].output & ~_addressPort[i].mask) | value[i];
+    SREG = oldSREG;
+  }
 
   return;
 }
 
-byte DomoS::SeparateCommandBySpace()
-/*	Separate the _command string into two string:
- 	The _subCommand string which contain the first word of _command before a space and the _command
- 	string which contain the original _command string whitouth the word in _subCommand
- 	
- 	Debugged: OK
- 	Added in the first while the control for the string terminator
- 	Added a control for eliminate the space after a word
- 	Solved an error in the do...while
+void DomoS::BuildAddressPorts()
+/*	Group the addressing pins by port, finding for each pin its port and its bit, and for each
+ 	port the bits used by the addressing pins
+ 	A pin without a port has no output register, on AVR SetAddressing would write the cell 0 of
+ 	the RAM: AskData and GetConfigurationDataFromEeprom refuse it, if it's there anyway it's left
+ 	out whit an empty mask and an error is set
  */
 {
   byte i, j;
-  byte readChar;
+  volatile byte* output;
 
-  readChar = 0; //Assume we don't read any character
-  i = 0; 
-  j = 0;
+  _numAddressPort = 0;
 
-  //Cycle until hw found a space or _subCommand is too long
-  while ((_command[i] != ' ') && (_command[i] != '\0') && (j < SUBSTRINGMAXLEN))
+  for (i = 0; i < _numAddressPin; i++)
   {
-    _subCommand[j] = _command[i]; //Copy the first word
-    i++; 
-    j++;
+    if (digitalPinToPort(_addressPin[i]) == NOT_A_PORT)
+    {
+      _lastError = ADDRESSPINNOTVALID;
+      _addressPinPort[i] = 0;
+      _addressPinMask[i] = 0; //SetAddressing never sets its bit
+    }
+    else
+    {
+      output = portOutputRegister(digitalPinToPort(_addressPin[i]));
+
+      //Search the port of the pin between the ones already found
+      for (j = 0; (j < _numAddressPort) && (_addressPort[j].output != output); j++);
+
+      if (j == _numAddressPort) //A new port
+      {
+        _addressPort[j].output = output;
+        _addressPort[j].mask = 0;
+        _numAddressPort++;
+      }
+
+      _addressPinPort[i] = j;
+      _addressPinMask[i] = digitalPinToBitMask(_addressPin[i]);
+      _addressPort[j].mask |= _addressPinMask[i];
+    }
   }
 
-  if (j < SUBSTRINGMAXLEN) //Check if _subCommand is too long
-  {
-    _subCommand[j] = '\0'; //Terminate the string
-    readChar = j; //Set the number of character readed
+  return;
+}
 
-    if (_command[i] == ' ') //_command[i] can be ' ' or '\0', go jump of one character if is a
-      //space, not if is the string terminator
-      i++;
+void DomoS::SplitCommand()
+/*	Split the _command string into its words, reading it only once
+ 	Every space after a word is replaced by a string terminator, so every word can be used
+ 	directly as a string without copying it
+ 	More spaces between two words are handled as a single space
+ */
+{
+  byte i;
+
+  _numToken = 0;
+  _nextToken = 0;
 
-    //Start deletting the first word into _command string
-    j = 0;
-    //Cycle until we found the string terminator
-    do
+  i = 0;
+  //Cycle until the string terminator
+  while (_command[i] != '\0')
+  {
+    if (_command[i] == ' ') //Skip the spaces between the words
     {
-      _command[j] = _command[i];
-      j++; 
+      _command[i] = '\0';
       i++;
     }
-    while(_command[i - 1] != '\0');
-
-    _command[j]= '\0'; //Terminate the string
+    else
+    {
+      //Start a new word and go to its end
+      _tokenStart[_numToken] = i;
+      while ((_command[i] != ' ') && (_command[i] != '\0'))
+        i++;
+      _tokenLen[_numToken] = i - _tokenStart[_numToken];
+      _numToken++;
+    }
   }
-  else
-  {
-    _lastError = SUBCOMMANDSTRINGTOOLONG; //Set the error
-    //Deletting _command and _subCommand
-    _command[0] = '\0';
-    _subCommand[0] = '\0';
 
-    readChar = -1; //Setting readChar at an error state
-  }
+  //The empty word after the last one
+  _tokenStart[_numToken] = i;
+  _tokenLen[_numToken] = 0;
 
-  return readChar;
+  return;
 }
 
-byte DomoS::CompareSubCommand()
-/*	Compare the _subCommand string whit the commands dictnionary
- 	For avoid useless comparisons we set and start and end parameters
- 	If don't found the command return the successive index
- 	
- 	Debugged: OK
+byte DomoS::NextToken(char* & token)
+/*	Point token to the next word of the _command string and return its length
+ 	When the words are finished token point to an empty string and 0 is returned
  */
 {
-  boolean find;
-  byte i;
+  token = _command + _tokenStart[_nextToken];
 
-  find = false; 
-  i = 0;
-  //Cycle until find or don't find the command
-  while((!find) && (i < NCOMMAND))
+  if (_nextToken < _numToken)
   {
-    if(strcmp(_subCommand, COMMAND[i]) == 0) //Compare _subCommand whit a command
-      find = true;
-    else
-      i++;
+    _nextToken++;
+    return _tokenLen[_nextToken - 1];
   }
 
-  return i;
+  return 0;
 }
 
 void DomoS::CommandToLowerCase()
@@ -545,21 +963,75 @@ void DomoS::Work()
  	Debugged: Don't need to be debugged
  */
 {
+  char* token;
+  byte readChar;
+  byte numCommand;
+  unsigned long start; //Value of micros() when the command started
+  unsigned long reads, writes; //Storage accesses before the command started
+
+  Actuate(); //Go ahead with the peripheral being turned
+
   if (GetError() == OK) //Control if there's an error pending
   {
     if(Serial.available()) //Controll if there's something to be read from the serial port
     {
       if(FetchCommand()) //Fetch the command from the serial port
       {
-        CommandToLowerCase(); //Convert the _command string to lower case
-        if(SeparateCommandBySpace() > 0) //Separate _command string and check if separation
-          //end correclty
+        if (!_inFrame)
+        {
+          CommandToLowerCase(); //Convert the _command string to lower case
+          SplitCommand(); //Separate _command string into words
+          readChar = NextToken(token);
+          _commandReply = NOREPLY;
+          _replyDeferred = false;
+
+          if ((token[0] == '#') && (isdigit(token[1])) && (atoi(token + 1) < 256)) //The id of the command
+          {
+            _commandReply = TEXTREPLY;
+            _commandId = atoi(token + 1);
+            readChar = NextToken(token);
+          }
+        }
+        else
+          readChar = 1; //A binary frame is always a command
+
+        if((readChar > 0) || (_commandReply == TEXTREPLY)) //Check if there's at least a word, a command whit id is always answered
         {
-          DoCommand(CompareSubCommand()); //Compare the command whit the dictionary and
-          //execute the relative command
+          //Take the statistics of the command before executing it
+          start = micros();
+          reads = _storageReads;
+          writes = _queuedWrites; //The writings are delayed, charge the command for the cells it changed
+
+          if (_inFrame)
+            numCommand = DoFrame(); //Execute the frame and answer to it
+          else
+          {
+            numCommand = GetCommand(token, readChar);
+            DoCommand(numCommand); //Compare the command whit the dictionary and
+            //execute the relative command
+
+            if ((_commandReply != NOREPLY) && (!_replyDeferred))
+            {
+              SendReply(_commandReply, _commandId, _lastError);
+              _lastError = OK; //Already answered, don't print it
+            }
+          }
+
+          _lastCommand = numCommand;
+          _lastCommandTime = micros() - start;
+          _lastCommandReads = _storageReads - reads;
+          _lastCommandWrites = _queuedWrites - writes;
         }
       }
     }
+    else if (_numDirty > 0) //Nothing to do, use the time for writing a cell into the storage
+      FlushStorage();
+    else if (_wiping)
+      WipeStep(); //Go ahead with reset wipe, nothing else must touch the storage
+    else if ((_numSlot >= _maxSlot) && (_numPeripheral + MAXHOLES <= _maxSlot))
+      CompactStep(); //Still nothing to do and the end of the table was reached, sort a peripheral
+    else if (_snapshot.check != SNAPSHOTCHECK)
+      SaveSnapshot(); //Everything is written, keep it for a reset
   }
   else
     ThrownError();
@@ -567,59 +1039,264 @@ void DomoS::Work()
   return;
 }
 
-byte DomoS::GetCommand(char* command)
-/*	Get the index of a command from the COMMAND array
+byte DomoS::DoFrame()
+/*	Execute the binary frame read by FetchCommand and send the answer
+ 	The fields are put in the same structures filled by the text commands, then the same
+ 	functions of create, turn and delete are called
+ 	The error isn't printed but sent as the status of the answer, a turn queued is answered
+ 	when it ends
+ 	While the storage is wiped the frames are refused like the text commands
+ 	Return the command executed, NCOMMAND if the frame wasn't valid
  */
 {
-  boolean find;
+  byte* frame; //length, opcode, id, fields, CRC
+  byte length;
+  byte numCommand;
+  byte id;
+  byte payload[1]; //Only create answers whit a field
+  byte numPayload;
   byte i;
-
-  find = false; 
-  i = 0;
-  //Cycle until find or don't find the command
-  while((!find) && (i < NCOMMAND))
+  DomoSFileBody peripheral;
+  DomoSActuation actuation;
+
+  frame = (byte*)_command;
+  length = frame[0];
+  _inFrame = false;
+  _commandReply = NOREPLY;
+  _replyDeferred = false;
+
+  numCommand = NCOMMAND;
+  id = 0;
+  numPayload = 0;
+  if ((length < 2) || (frame[length + 1] != Crc8(frame, length + 1)))
+    _lastError = FRAMENOTVALID;
+  else
   {
-    if(strcmp(command, COMMAND[i]) == 0) //Compare _command whit a command
-      find = true;
+    id = frame[2];
+    numCommand = frame[1];
+    _commandReply = FRAMEREPLY;
+    _commandId = id;
+
+    if (_wiping) //The storage is being cleared, the frames would write it again
+      _lastError = WIPEINPROGRESS;
     else
-      i++;
-  }
+      switch (numCommand)
+      {
+      case FRAMECREATE:
+        if ((length >= 4) && (length - 4 < MAXNAMELEN))
+        {
+          BlankNewPeripheral(peripheral);
+          if (frame[3] != 0) //0 for the first free number
+            peripheral.number = frame[3];
+          peripheral.channel = frame[4];
+          memcpy(peripheral.name, frame + 5, length - 4);
+          peripheral.name[length - 4] = '\0';
+
+          if (CreatePeripheral(peripheral))
+          {
+            payload[0] = peripheral.number;
+            numPayload = 1;
+          }
+        }
+        else
+          _lastError = FRAMENOTVALID;
+        break;
 
-  return i;
-}
+      case FRAMETURN:
+        if ((length >= 4) && (length - 3 <= MAXTARGET))
+        {
+          actuation.numTarget = 0;
+          for (i = 4; (i <= length) && (AddTurnTarget((frame[i] != 0) ? SearchPeripheralByNumber(frame[i]) : -1, actuation)); i++);
 
-boolean DomoS::FetchCommand()
-/*	Fetch a command from the serial port
- 	This function can be changed to whatever change the _command for input of commands
+          if (i > length) //All the peripherals can be turned
+          {
+            actuation.value = frame[3];
+            TurnPeripherals(actuation);
+          }
+        }
+        else
+          _lastError = FRAMENOTVALID;
+        break;
+
+      case FRAMEDELETE:
+        if (length == 3)
+        {
+          i = ((frame[3] != 0) ? SearchPeripheralByNumber(frame[3]) : -1);
+          if (i != (byte)-1)
+            DeletePeripheral(i);
+          else
+            _lastError = PERIPHERALNOTFOUND;
+        }
+        else
+          _lastError = FRAMENOTVALID;
+        break;
+
+      default:
+        _lastError = COMMANDNOTRECOGNIZED;
+        numCommand = NCOMMAND;
+        break;
+      }
+  }
+
+  if (!_replyDeferred) //A turn is answered by Actuate
+    SendFrame(id, _lastError, payload, numPayload);
+  _lastError = OK; //Already sent, don't print it
+
+  return numCommand;
+}
+
+void DomoS::SendReply(byte reply, byte id, byte status)
+/*	Answer to a command whit an id, as text or as a frame whit no payload
+ */
+{
+  if (reply == TEXTREPLY)
+  {
+    Serial.print('#');
+    Serial.print(id);
+    Serial.print(' ');
+    Serial.println(status);
+  }
+  else if (reply == FRAMEREPLY)
+    SendFrame(id, status, NULL, 0);
+
+  return;
+}
+
+void DomoS::SendFrame(byte id, byte status, const byte payload[], byte length)
+/*	Send the answer to a binary frame: FRAMESYNC, length, id, status, payload, CRC
+ */
+{
+  byte frame[FRAMEMAXLEN + 2]; //length, id, status, payload, CRC
+
+  frame[0] = length + 2;
+  frame[1] = id;
+  frame[2] = status;
+  memcpy(frame + 3, payload, length);
+  frame[length + 3] = Crc8(frame, length + 3);
+
+  Serial.write(FRAMESYNC);
+  Serial.write(frame, length + 4);
+
+  return;
+}
+
+byte DomoS::GetCommand(char* command, byte length)
+/*	Get the index of a command from the COMMAND array
+ */
+{
+  byte i;
+
+  //Cycle until find or don't find the command
+  for (i = 0; (i < NCOMMAND) && (!CompareKeyword(command, length, &COMMAND[i].keyword)); i++);
+
+  return i;
+}
+
+byte DomoS::GetSubCommand(char* command, byte length)
+/*	Get the index of a sub command from the SUBCOMMAND array
+ */
+{
+  byte i;
+
+  //Cycle until find or don't find the sub command
+  for (i = 0; (i < NSUBCOMMAND) && (!CompareKeyword(command, length, &SUBCOMMAND[i])); i++);
+
+  return i;
+}
+
+boolean DomoS::CompareKeyword(char* command, byte length, const DomoSKeyword* keyword)
+/*	Tell if the word command, long length character, is the keyword
+ 	Compare the whole words only if length and first character are equal
+ 	keyword point to the flash memory
+ */
+{
+  const char* word;
+
+  if (length != pgm_read_byte(&keyword->length))
+    return false;
+
+  word = (const char*)pgm_read_ptr(&keyword->word);
+
+  return ((command[0] == (char)pgm_read_byte(word)) && (memcmp_P(command, word, length) == 0));
+}
+
+boolean DomoS::FetchCommand()
+/*	Fetch a command from the serial port
+ 	This function can be changed to whatever change the _command for input of commands
+ 	Append to _command all the character already arrived, without waiting for the others,
+ 	the command is complete only when a line terminator ('\n' or '\r') arrive
+ 	If the line is too long set an error and ignore the rest of the line
+ 	A FRAMESYNC at the start of a line starts a binary frame, its bytes after FRAMESYNC are put in
+ 	_command and it's complete when length + 2 bytes arrived; a frame not finished in
+ 	FRAMETIMEOUT is ignored, so a lost byte doesn't block the next frames
  	
- 	Debugged: In part
- 	Need more tests
- 	Logically is right, but in case the user input too much character the serial buffer wont be free
+ 	Debugged: OK
  */
 {
   boolean ok;
-  byte i;
+  char c;
 
-  i = 0; 
-  ok = true; //Assume to read a correct string
-  //Cycle until a character is avaible from the serial port and too many character are read
-  while ((Serial.available() > 0) && (i < STRINGMAXLEN)) 
+  ok = false; //Assume the command line isn't complete
+  if ((_inFrame) && (millis() - _frameTime > FRAMETIMEOUT)) //The rest of the frame was lost
   {
-    _command[i] = Serial.read(); //Put the readed character into the _command string
-    i++;
-    delay(2); //Wait 2ms for allowing the serial buffer to fill whit the next character
+    _inFrame = false;
+    _commandLen = 0;
   }
 
-  //Check if too many character was read
-  if (i < STRINGMAXLEN)
-    _command[i]='\0'; //Terminate the string
-  else
+  //Cycle until the avaible character are finished or the command line is complete
+  while ((Serial.available() > 0) && (!ok))
   {
-    //Too much character was read
-    Serial.flush(); //Free the serial buffer
-    _lastError = COMMANDSTRINGTOOLONG; //Set the error
-    _command[0] = '\0'; //Empty the string
-    ok = false;
+    c = Serial.read();
+
+    if (_inFrame)
+    {
+      _command[_commandLen] = c;
+      _commandLen++;
+
+      if ((byte)_command[0] > FRAMEMAXLEN) //Not a frame, wait the next FRAMESYNC
+      {
+        _inFrame = false;
+        _commandLen = 0;
+      }
+      else if (_commandLen == (byte)_command[0] + 2) //Length, the bytes counted by it and CRC
+      {
+        _commandLen = 0;
+        ok = true;
+      }
+    }
+    else if (((byte)c == FRAMESYNC) && (_commandLen == 0) && (!_discardLine))
+    {
+      _inFrame = true;
+      _frameTime = millis();
+    }
+    else if ((c == '\n') || (c == '\r')) //Check if the line is finished
+    {
+      if (_discardLine) //The end of a too long line, start again from an empty line
+        _discardLine = false;
+      else if (_commandLen > 0) //Ignore empty lines, es: the '\n' after a '\r'
+      {
+        _command[_commandLen] = '\0'; //Terminate the string
+        ok = true;
+      }
+
+      _commandLen = 0;
+    }
+    else if (!_discardLine)
+    {
+      if (_commandLen < (STRINGMAXLEN - 1)) //Leave space for the string terminator
+      {
+        _command[_commandLen] = c; //Put the readed character into the _command string
+        _commandLen++;
+      }
+      else
+      {
+        //Too much character was read
+        _lastError = COMMANDSTRINGTOOLONG; //Set the error
+        _discardLine = true; //Ignore the rest of the line
+        _commandLen = 0;
+        _command[0] = '\0'; //Empty the string
+      }
+    }
   }
 
   return ok;
@@ -631,36 +1308,18 @@ void DomoS::DoCommand(byte numCommand)
  	Debugged: Don't need to be debugged
  */
 {
-  switch (numCommand)
-  {
-  case 0:
-    Create();
-    break;
-
-  case 1:
-    Turn();
-    break;
-
-  case 2:
-    Delete();
-    break;
+  DomoSAction action;
 
-  case 3:
-    Exit();
-    break;
-
-  case 6:
-    Reset();
-    break;
-
-  case 7:
-    List();
-    break;
-
-  default:
+  if (_wiping) //The storage is being cleared, the commands would write it again
+    _lastError = WIPEINPROGRESS;
+  else if (numCommand < NCOMMAND)
+  {
+    memcpy_P(&action, &COMMAND[numCommand].action, sizeof(action)); //Read the function from the flash memory
+    (this->*action)(); //Call the function of the command
+  }
+  else
     //If the command aren't recognized, return an error
     _lastError = COMMANDNOTRECOGNIZED;
-  }
 
   return;
 }
@@ -669,123 +1328,173 @@ void DomoS::Create()
 /*	This fuction act the creation of a new peripheral
  	Check the _command string for all the configuration parameters
  	
- 	If everithing went right, write this new peripheral into the EEPROM/file
+ 	If everithing went right, write this new peripheral into the storage
  */
 {
-  byte readChar; //The number opf character separed from the separator
+  byte readChar; //The number opf character of the word read
+  char* token; //The word read
   boolean error;
   DomoSFileBody newPeripheral; //The new peripheral to be write
-  byte val, i;
+  byte i;
 
   BlankNewPeripheral(newPeripheral); //Initialize the newPeripheral to known value
 
   error = false; //Assume there's no error
-  if (_numPeripheral < ((1 << _numAddressPin) - 1))
+  readChar = NextToken(token);
+  if(readChar > 0)
   {
-    if(SeparateCommandBySpace() > 0)
+    //Cycle when we have more parameters and there're no error
+    do //Start cycle for checking parameters
     {
-      //Cycle when we have more parameters and there're no error
-      do //Start cycle for checking parameters
+      switch(GetSubCommand(token, readChar)) //Start extern switch
       {
-        switch(CompareSubCommand()) //Start extern switch
+      case NAMESUBCOMMAND: //Define the name of the new peripheral
+        readChar = NextToken(token);
+        if (readChar > 0) //Check if there's the name
         {
-        case 4: //Define the name of the new peripheral
-          readChar = SeparateCommandBySpace();
-          if (readChar > 0) //Check if separation goes right
+          if(readChar < MAXNAMELEN) //Check if the name wasn't too long
           {
-            if(readChar < MAXNAMELEN) //Check if the name wasn't too long
-            {
-              for (i = 0; _subCommand[i] != '\0'; i++) //Copy the name into the
-                //new peripheral
-                newPeripheral.name[i] = _subCommand[i];
+            for (i = 0; token[i] != '\0'; i++) //Copy the name into the
+              //new peripheral
+              newPeripheral.name[i] = token[i];
 
-              newPeripheral.name[i] = '\0';
-            }
-            else //Else set an error
-            {
-              _lastError = NAMETOOLONG;
-              error = true;
-            }
+            newPeripheral.name[i] = '\0';
           }
-          else
+          else //Else set an error
           {
-            _lastError = NAMENOTDEFINED;
+            _lastError = NAMETOOLONG;
             error = true;
           }
-          break;
+        }
+        else
+        {
+          _lastError = NAMENOTDEFINED;
+          error = true;
+        }
+        break;
 
-          //Define the custom address name for the new peripheral
-        case 5:
-          readChar = SeparateCommandBySpace();
+        //Define the custom address name for the new peripheral
+      case ASSUBCOMMAND:
+        readChar = NextToken(token);
 
-          if (readChar > 0) //Check if separation goes right
+        if (readChar > 0) //Check if there's the address
+        {
+          if (token[0] == 'b') //Check if the user set a binary address
           {
-            if (_subCommand[0] == 'b') //Check if the user set a binary address
+            if(readChar > (_numAddressPin + 1)) //Check if there're too many bit
             {
-              if(readChar > (_numAddressPin + 1)) //Check if there're too many bit
-              {
-                error = true;
-                _lastError = BINARYNUMBERTOOLONG;
-              }
-              else
-              {
-                SubCommandShiftLeft();
-                //Convert the binary string into a decimal number
-                newPeripheral.number = ConvertBinaryStringToDecimal();
-              }
+              error = true;
+              _lastError = BINARYNUMBERTOOLONG;
             }
             else
             {
-              //Convert the decimal string into a decimal number
-              val = (byte)atoi(_subCommand);
-              if (val < (1 << _numAddressPin))
-                newPeripheral.number = val;
-              else
-              {
-                error = true;
-                _lastError = DECIMALNUMBERTOOBIG;
-              }
+              //Convert the binary string, after the b, into a decimal number
+              newPeripheral.number = ConvertBinaryStringToDecimal(token + 1);
             }
           }
-          else //Set an error state
+          else
           {
-            error = true;
-            _lastError = ASNOTDEFINED;
+            //Convert the decimal string into a decimal number, CreatePeripheral checks it
+            newPeripheral.number = (byte)atoi(token);
           }
-          break;
-
-        default: //Set an error if no command was recognized
-          _lastError = SUBCOMMANDNOTRECOGNIZED;
+        }
+        else //Set an error state
+        {
           error = true;
-          break;
-        } //End extern switch
-        readChar = SeparateCommandBySpace();
-      }
-      while((readChar > 0) && (!error)); //End cycle for checking parameters
-    }
+          _lastError = ASNOTDEFINED;
+        }
+        break;
 
-    //If there're no error try creating the new peripheral
-    if(!error)
-    {
-      //Check if we have all the data needed
-      if (CreateParameterCheck(newPeripheral))
-      {
-        //Write the peripheral
-        if (WritePeripheral(newPeripheral, _numPeripheral))
+        //Define the output channel of the new peripheral
+      case ONSUBCOMMAND:
+        readChar = NextToken(token);
+
+        if ((readChar > 0) && (atoi(token) >= 0) && (atoi(token) <= CHANNELMASK))
+          newPeripheral.channel = atoi(token); //CreatePeripheral checks if the channel exists
+        else
         {
-          UpdateNumPeripheral('+');
-          ComposeStringPeripheral(newPeripheral, 6);
+          error = true;
+          _lastError = CHANNELNOTVALID;
         }
-      }
+        break;
+
+      default: //Set an error if no command was recognized
+        _lastError = SUBCOMMANDNOTRECOGNIZED;
+        error = true;
+        break;
+      } //End extern switch
+      readChar = NextToken(token);
     }
+    while((readChar > 0) && (!error)); //End cycle for checking parameters
   }
-  else
-    _lastError = PERIPHERALMAXIMUMNUMBERREACH;
 
+  //If there're no error try creating the new peripheral
+  if ((!error) && (CreatePeripheral(newPeripheral)))
+    ComposeStringPeripheral(newPeripheral, 6);
 
   return;
 }
 
+boolean DomoS::CreatePeripheral(DomoSFileBody & peripheral)
+/*	Create a new peripheral, shared by the create command and the binary frames
+ 	Check the values set by the caller, fill the missing ones and write the peripheral at the
+ 	end of the table
+ 	Return false and set an error if the peripheral can't be created
+ */
+{
+  boolean ok;
+  byte position; //The slot where the new peripheral is written
+
+  ok = false; //Assume the peripheral can't be created
+  //Check the values, then if we have all the data needed
+  if ((CheckNewPeripheral(peripheral, peripheral.number != (byte)-1, 0)) && (CreateParameterCheck(peripheral)))
+  {
+    //Write the peripheral at the end of the table, or in a free slot if the end was reached
+    position = SearchFreeSlot(peripheral.number);
+    if ((position != (byte)-1) && (WritePeripheral(peripheral, position)))
+    {
+      if ((position < _numSorted) && (!KeepsOrder(position, peripheral.number)))
+        _numSorted = position; //Out of order, the sorted part of the table ends before it
+      else if ((position == _numSorted) && (KeepsOrder(position, peripheral.number)))
+        _numSorted++; //Created in order, the sorted part of the table grows
+      _compacting = false; //The table changed, a compaction in progress must start again
+      if (position >= _numSlot)
+        _numSlot = position + 1;
+      MarkNumber(peripheral.number, true);
+      UpdateNumPeripheral('+');
+      ok = true;
+    }
+  }
+
+  return ok;
+}
+
+boolean DomoS::CheckNewPeripheral(const DomoSFileBody & peripheral, boolean numberCustom, byte numAccepted)
+/*	Check the values of a new peripheral that don't depend on the other peripherals, setting
+ 	the error if one isn't allowed
+ 	The number is checked only if numberCustom, numAccepted is the number of peripherals
+ 	already accepted but not yet written, as the records before it in an import line
+ */
+{
+  boolean ok;
+  byte packed[PACKEDNAMELEN]; //Only used for checking the name
+
+  ok = false;
+  if (_numPeripheral + numAccepted >= ((1 << _numAddressPin) - 1))
+    _lastError = PERIPHERALMAXIMUMNUMBERREACH;
+  //Check if the name can be stored, # at the start means a number for turn
+  else if ((!PackName(peripheral.name, packed)) || (peripheral.name[0] == '#'))
+    _lastError = NAMEINVALIDCHARACTER;
+  else if ((numberCustom) && (peripheral.number >= (1 << _numAddressPin)))
+    _lastError = DECIMALNUMBERTOOBIG;
+  else if (peripheral.channel >= _numChannel)
+    _lastError = CHANNELNOTVALID;
+  else
+    ok = true;
+
+  return ok;
+}
+
 void DomoS::BlankNewPeripheral (DomoSFileBody & peripheral)
 /*	Initialize a peripheral to known values
  	
@@ -794,6 +1503,7 @@ void DomoS::BlankNewPeripheral (DomoSFileBody & peripheral)
 {
   peripheral.name[0] = '\0';
   peripheral.number = -1;
+  peripheral.channel = 0;
 
   return;
 }
@@ -838,60 +1548,127 @@ boolean DomoS::CreateParameterCheck(DomoSFileBody & peripheral)
 }
 
 boolean DomoS::WritePeripheral(DomoSFileBody peripheral, byte position)
-/*	Write the peripheral on the EEPROM or on the SD if was selected
+/*	Write the peripheral to the storage, the EEPROM or the SD if was selected
+ 	The name is packed, if it's the standard name (the number) nothing is stored for it
  	
- 	Debugged: Don't need to be debugged 
+ 	Debugged: OK
+ 	Solved a erroneus increment of i
  */
 {
+  DomoSFileRecord record;
+  char standardName[MAXNAMELEN];
   boolean ok;
 
   ok = true; //Assume the writing goes right
 
-  if(_writeToEeprom == (byte)-1) //Check if a CSPin was set
-    ok = WritePeripheralToEeprom(peripheral, position); //If not write to EEPROM
-  /*else
-   		ok = WritePeripheralToSd(peripheral, position);*/  //Because i don't own a sd card to test, for the
-  //instance i wont develope this function
+  if (position < _maxSlot) //Check if the storage can contain the new peripheral
+  {
+    itoa((int)peripheral.number, standardName, 10);
+    if (strcmp(peripheral.name, standardName) == 0)
+      memset(record.name, 0, PACKEDNAMELEN); //Empty name, GetPeripheralName will use the number
+    else
+      PackName(peripheral.name, record.name);
+    record.name[PACKEDNAMELEN - 1] |= peripheral.channel; //The last two bits aren't used by the name
+    record.number = peripheral.number;
+
+    WriteStorage(PeripheralAddress(position), (byte*)&record, sizeof(record));
+
+    _snapshot.nameIndex[position] = HashName(peripheral.name); //Keep the name index in step with the storage
+    if (_numberMap)
+      WriteStorage(NumberMapAddress(peripheral.number), position);
+  }
+  else	//ERROR, the storage is full
+  {
+    ok = false;
+    _lastError = EEPROMISFULL;
+  }
 
-    return ok;
+  return ok;
 }
 
-boolean DomoS::WritePeripheralToEeprom(DomoSFileBody peripheral, byte position)
-/*	Write the peripheral to the EEPROM
- 	
- 	Debugged: OK
- 	Solved a erroneus increment of i
+boolean DomoS::PackName(const char name[], byte packed[])
+/*	Pack a name into PACKEDNAMELEN byte, 6 bit for each character
+ 	Every character is its position in NAMECHARSET plus one, the first character in the
+ 	highest bits of the first byte, the missing character are 0
+ 	Return false if a character isn't in NAMECHARSET, it's packed as a '_'
  */
 {
-  DomoSFileHeader configuration; //Only used for sizeof function
-  int start; //The starting address
-  byte i, j;
   boolean ok;
+  byte i, j;
+  byte code;
+  byte bit; //The next bit to be written
 
-  ok = true; //Assume the writing goes right
-
-  //Start to write the new peripheral from the address described by this formula
-  //2 = the first two cells are occupied by the setup values
-  //sizeof(configuration) = the next cells are occupied by the configuration parameters
-  //In the EEPROM there're _numPeripheral peripheral big sizeof(peripheral), so go ahead
-  //for all this peripheral
-  start = 2 + sizeof(configuration) + (sizeof(peripheral) * position);
+  ok = true; //Assume all the character are allowed
+  memset(packed, 0, PACKEDNAMELEN);
 
-  if ((start + sizeof(peripheral)) < E2END) //Check if the EEPROM can contain the new peripheral
+  bit = 0;
+  for (i = 0; (i < (MAXNAMELEN - 1)) && (name[i] != '\0'); i++)
   {
-    //Start writing peripheral
-    for(j = 0; j < MAXNAMELEN; j++, start++)
-      EEPROM.write(start, peripheral.name[j]);
+    code = CharToCode(name[i]);
+    if (code == 0)
+    {
+      ok = false;
+      code = CharToCode('_');
+    }
 
-    EEPROM.write(start, peripheral.number);
+    for (j = 0; j < 6; j++, bit++)
+      if (code & (0x20 >> j))
+        packed[bit >> 3] |= (0x80 >> (bit & 7));
   }
-  else	//ERROR, the EEPROM is full
+
+  return ok;
+}
+
+void DomoS::GetRecordName(const DomoSFileRecord & record, char name[])
+/*	Put into char name[] the name of a record already in memory, as GetPeripheralName
+ */
+{
+  if ((record.name[0] >> 2) == 0) //The standard name
+    itoa((int)record.number, name, 10);
+  else
+    UnpackName(record.name, name);
+
+  return;
+}
+
+void DomoS::UnpackName(const byte packed[], char name[])
+/*	Unpack a name packed by PackName
+ */
+{
+  byte i, j;
+  byte code;
+  byte bit; //The next bit to be read
+
+  bit = 0;
+  i = 0;
+  do
   {
-    ok = false;
-    _lastError = EEPROMISFULL;
+    code = 0;
+    for (j = 0; j < 6; j++, bit++)
+      code = (code << 1) | ((packed[bit >> 3] >> (7 - (bit & 7))) & 1);
+
+    if (code != 0)
+    {
+      name[i] = pgm_read_byte(&NAMECHARSET[code - 1]);
+      i++;
+    }
   }
+  while ((code != 0) && (i < (MAXNAMELEN - 1)));
 
-  return ok;
+  name[i] = '\0';
+
+  return;
+}
+
+byte DomoS::CharToCode(char c)
+/*	Return the code of a character in a packed name, 0 if the character isn't allowed
+ */
+{
+  const char* position;
+
+  position = strchr_P(NAMECHARSET, c);
+
+  return (((c != '\0') && (position != NULL)) ? (position - NAMECHARSET + 1) : 0);
 }
 
 void DomoS::UpdateNumPeripheral(char type)
@@ -900,49 +1677,61 @@ void DomoS::UpdateNumPeripheral(char type)
  	Debugged: Don't need to be debugged
  */
 {
+  //Since version 1 the number of peripheral isn't stored, it's counted at startup
+  _snapshot.check = 0;
   if (type == '+')
     _numPeripheral++;
   else
     _numPeripheral--;
-  EEPROM.write(3, _numPeripheral);
-  //TODO Update also the number contained on the SDCard
 
   return;
 }
 
 void DomoS::Turn()
 /*	Act the Turn command
+ 	More peripherals can be turned at the same value separating their names whit commas
+ 	syntax: turn name1,name2,name3 high
+ 	syntax: turn #42 high
  */
 {
-  byte peripheral;
+  DomoSActuation actuation;
+  char* token;
   int val;
-  boolean addressing[_numAddressPin];
 
-  SeparateCommandBySpace();
+  NextToken(token);
 
-  peripheral = SearchPeripheralByName(_subCommand); //Find the peripheral
-  if(peripheral != (byte)-1) 
+  if(SearchTurnTargets(token, actuation)) //Find the peripherals
   {
-    SeparateCommandBySpace();
+    NextToken(token);
 
-    switch(_subCommand[0]) //Controll the first _subCommand character
+    switch(token[0]) //Controll the first character of the word
     {
     case '%': //If there's an % the user set a percentage
-      SubCommandShiftLeft(); //delete the % simbol
-      val = map(atoi(_subCommand), 0, 100, 0, 255); //Convert from percentage to val
+      val = atoi(token + 1); //Skip the % simbol
+
+      //Check if the percentage fits in val
+      if ((val >= 0) && (val <= 100))
+        val = map(val, 0, 100, 0, 255); //Convert from percentage to val
+      else
+      {
+        val = -1;
+        _lastError = STRANGETURNPARAMETER;
+      }
       break;
 
     case 'v': //If there's an v the user set a voltage
-      SubCommandShiftLeft(); //Delete the v simobl
-      val = atof(_subCommand);
+      val = atof(token + 1); //Skip the v simbol
 
       //Check if the voltage is too high or low
       if ((val >= 0) && (val <= 5))
-        val = map(atof(_subCommand), 0, 5, 0, 255); //Convert from volt to val
+        val = map(atof(token + 1), 0, 5, 0, 255); //Convert from volt to val
       else if (val < 0)
         _lastError = VOLTAGETOOLOW;
       else
+      {
+        val = -1; //Don't turn the peripherals
         _lastError = VOLTAGETOOHIGH;
+      }
       break;
 
     case 'l': //If there's an l the user set a logic low signal
@@ -961,115 +1750,850 @@ void DomoS::Turn()
 
     if (val > -1)
     {
-      byte number;
-      GetPeripheralNumber(peripheral, number);
-      //Convert the peripheral number into binary for the addressing
-      if (ConvertDecimalToBinary(number, addressing))
-      {
-        analogWrite(_outputPin, val); //Set the outputPin at val
-        delay(RCLOAD); //Wait for charging of rc circuit
-
-        SetAddressing(addressing); //Set the addressing line
-
-        delay(1000); //Wait for spread of signals
-
-        //Clean everything
-        analogWrite(_outputPin, 0);
-        ConvertDecimalToBinary(0, addressing);
-        SetAddressing(addressing);
-      }
-      else //If we can't convert into binary... IMPOSSIBURU
-      _lastError = BADTHINGSHAPPEN;
+      actuation.value = val;
+      TurnPeripherals(actuation);
     }
   }
-  else //If the peripheral isn't present set an error
-  _lastError = PERIPHERALNOTFOUND;
-}
-
-void DomoS::Exit()
-/*	Act the exit from the system
- 	
- 	Debugged: Don't need to be debugged
- */
-{
-  _on = false;
-  Serial.println(PHRASE[9]);
-  Serial.end();
 
   return;
 }
 
-void DomoS::SubCommandShiftLeft()
-/*	Shift of one character to left the _subCommand string
- 	
- 	Debugged: OK
- 	Corrected some typo
+void DomoS::TurnPeripherals(DomoSActuation & actuation)
+/*	Turn the targets of actuation at its value, shared by the turn command and the binary frames
+ 	Only queue the actuation, the real work is left to Actuate, that answers to the command
+ 	when the actuation ends if it has an id
  */
 {
-  byte i;
+  OrderTargets(actuation);
+  actuation.reply = _commandReply;
+  actuation.id = _commandId;
 
-  i = 0;
-  do
-  {
-    _subCommand[i] = _subCommand[i+1];
-    i++;
-  } 
-  while (_subCommand[i] != '\0');
+  if (QueueActuation(actuation))
+    _replyDeferred = (_commandReply != NOREPLY);
+  else
+    _lastError = ACTUATIONQUEUEFULL;
 
   return;
 }
 
-byte DomoS::SearchPeripheralByName(char peripheral[])
-/*	Search the peripheral by name
- 	The function return the index of the peripheral or -1 if not found
- 	
- 	Debugged: OK
+boolean DomoS::AddTurnTarget(byte peripheral, DomoSActuation & actuation)
+/*	Put the peripheral in the slot peripheral, -1 if it wasn't found, in the targets of actuation
+ 	Shared by the turn command and the binary frames
+ 	The same peripheral listed more times is turned only once
+ 	Return false and set an error if the peripheral can't be turned
  */
 {
-  boolean find;
-  byte i;
-  char name[MAXNAMELEN];
+  boolean ok;
+  byte j;
+  byte number;
 
-  find = false; //Assume we don't find the peripheral
-  //Cycle until we find the peripheral or the peripherals are finished
-  i = 0;
-  while ((i < _numPeripheral) && (!find))
+  ok = true; //Assume the peripheral can be turned
+  if (peripheral != (byte)-1)
   {
-    GetPeripheralName(i, name); //Get the name of the i-th peripheral
-
-    if (strcmp(peripheral, name) == 0) //Check if the name are equal
-      find = true; //We find the peripheral
-    else
-      i++; //Go ahead
-  }
+    GetPeripheralNumber(peripheral, number);
 
-  if (!find) //if the peripheral wasn't find set an error
-    i = -1;
+    //Check if the peripheral number can be handled by the addressing lines
+    if (number < (1 << _numAddressPin))
+    {
+      //Check if the peripheral was already listed
+      for (j = 0; (j < actuation.numTarget) && (actuation.target[j] != number); j++);
 
-  return i;
-}
+      if (j == actuation.numTarget)
+      {
+        if (actuation.numTarget < MAXTARGET)
+        {
+          actuation.target[actuation.numTarget] = number;
+          GetPeripheralChannel(peripheral, actuation.channel[actuation.numTarget]);
+          actuation.numTarget++;
+
+          if (actuation.channel[actuation.numTarget - 1] >= _numChannel) //Created with more channels
+          {
+            _lastError = CHANNELNOTVALID;
+            ok = false;
+          }
+        }
+        else
+        {
+          _lastError = TOOMANYTARGETS;
+          ok = false;
+        }
+      }
+    }
+    else //If we can't convert into binary... IMPOSSIBURU
+    {
+      _lastError = BADTHINGSHAPPEN;
+      ok = false;
+    }
+  }
+  else //If the peripheral isn't present set an error
+  {
+    _lastError = PERIPHERALNOTFOUND;
+    ok = false;
+  }
+
+  return ok;
+}
+
+boolean DomoS::SearchTurnTargets(char list[], DomoSActuation & actuation)
+/*	Search all the peripherals listed in list, separated by commas, and put their
+ 	numbers in the targets of actuation
+ 	A peripheral can be listed by name or by number writing # before it
+ 	The same peripheral listed more times is turned only once
+ 	Return false and set an error if a peripheral can't be turned
+ */
+{
+  boolean ok;
+  byte start, i;
+  byte peripheral;
+  int val; //The number written after #
+  boolean last;
+
+  ok = true; //Assume all the peripherals will be found
+  actuation.numTarget = 0;
+
+  start = 0;
+  last = false;
+  //Cycle until all the names are read or there's an error
+  while ((!last) && (ok))
+  {
+    //Search the end of the current name and terminate it
+    i = start;
+    while ((list[i] != ',') && (list[i] != '\0'))
+      i++;
+
+    if (list[i] == '\0')
+      last = true;
+    list[i] = '\0';
+
+    if (list[start] == '#') //Find the peripheral by number
+    {
+      val = atoi(list + start + 1);
+      peripheral = (((val > 0) && (val < 256)) ? SearchPeripheralByNumber(val) : -1);
+    }
+    else
+      peripheral = SearchPeripheralByName(list + start); //Find the peripheral
+    ok = AddTurnTarget(peripheral, actuation);
+
+    start = i + 1; //Go to the next name
+  }
+
+  return ok;
+}
+
+void DomoS::OrderTargets(DomoSActuation & actuation)
+/*	Order the targets of actuation so that every target differs from the previous in as few
+ 	addressing lines as possible
+ 	The addressing lines start all at zero, so the first target is the one with less bits set
+ */
+{
+  byte i, j, best;
+  byte previous;
+  byte swap;
+
+  previous = 0;
+  for (i = 0; i < actuation.numTarget; i++)
+  {
+    //Search the nearest target to the previous one between the ones not yet ordered
+    best = i;
+    for (j = i + 1; j < actuation.numTarget; j++)
+      if (CountBits(actuation.target[j] ^ previous) < CountBits(actuation.target[best] ^ previous))
+        best = j;
+
+    swap = actuation.target[i];
+    actuation.target[i] = actuation.target[best];
+    actuation.target[best] = swap;
+    swap = actuation.channel[i];
+    actuation.channel[i] = actuation.channel[best];
+    actuation.channel[best] = swap;
+
+    previous = actuation.target[i];
+  }
+
+  return;
+}
+
+byte DomoS::CountBits(byte value)
+/*	Count the number of bits set in value
+ */
+{
+  byte count;
+
+  for (count = 0; value != 0; count++)
+    value &= value - 1; //Clear the lowest bit set
+
+  return count;
+}
+
+boolean DomoS::QueueActuation(DomoSActuation & actuation)
+/*	Put an actuation at the end of the actuation queue
+ 	Return false if the queue is full
+ */
+{
+  boolean ok;
+
+  ok = true; //Assume there's space in the queue
+
+  if (_numActuation < MAXACTUATION)
+  {
+    _actuation[(_firstActuation + _numActuation) % MAXACTUATION] = actuation;
+    _numActuation++;
+  }
+  else
+    ok = false;
+
+  return ok;
+}
+
+void DomoS::Actuate()
+/*	Go ahead with the queued actuations
+ 	Never wait, if the time of the current state isn't passed simply return
+ 	so Work can go on reading and checking the next commands
+ 	The targets are addressed one at a time in the order they were queued, but every channel
+ 	is charged as soon as possible at the value of its next target, so the charge of a channel
+ 	goes on while the target of another channel is settling
+ */
+{
+  if (_settling && ((millis() - _actuationTime) >= SETTLE)) //The current target was actuated
+  {
+    _settling = false;
+    _currentTarget++;
+    if (_currentTarget == _actuation[_firstActuation].numTarget)
+    {
+      SendReply(_actuation[_firstActuation].reply, _actuation[_firstActuation].id, OK);
+
+      //Remove the actuation from the queue
+      _firstActuation = (_firstActuation + 1) % MAXACTUATION;
+      _numActuation--;
+      _currentTarget = 0;
+    }
+  }
+
+  if (!_settling)
+  {
+    //If the channel of the next target is ready address it directly, the address lines
+    //go from a target to the next one without passing through zero
+    if ((_numActuation > 0) && (IsChannelReady(_actuation[_firstActuation].channel[_currentTarget],
+      _actuation[_firstActuation].value)))
+      AddressTarget();
+    else if (_addressedChannel != NOCHANNEL) //Nobody must read the channels while they change
+    {
+      SetAddressing(0);
+      _addressedChannel = NOCHANNEL;
+    }
+  }
+
+  ChargeChannels();
+
+  return;
+}
+
+boolean DomoS::IsChannelReady(byte channel, byte value)
+/*	Tell if channel is at value since at least RCLOAD ms, the time of charging of rc circuit
+ */
+{
+  return ((_channelValue[channel] == value) && ((millis() - _channelTime[channel]) >= RCLOAD));
+}
+
+void DomoS::ChargeChannels()
+/*	Set every channel at the value of its next queued target, or at 0 if there isn't
+ 	The channel of the addressed peripheral isn't changed, its peripheral is reading it
+ */
+{
+  byte wanted[MAXCHANNEL]; //The value of the next target of each channel
+  byte found; //A bit for every channel, set if its next target was found
+  byte i, j, k;
+  byte channel;
+
+  found = 0;
+  memset(wanted, 0, sizeof(wanted));
+
+  //Cycle for the queued targets, in the order they'll be addressed
+  j = _currentTarget;
+  for (i = 0; i < _numActuation; i++)
+  {
+    k = (_firstActuation + i) % MAXACTUATION;
+    for (; j < _actuation[k].numTarget; j++)
+    {
+      channel = _actuation[k].channel[j];
+      if (!(found & (1 << channel)))
+      {
+        found |= (1 << channel);
+        wanted[channel] = _actuation[k].value;
+      }
+    }
+    j = 0; //The next actuations start from the first target
+  }
+
+  for (i = 0; i < _numChannel; i++)
+  {
+    if ((i != _addressedChannel) && (_channelValue[i] != wanted[i]))
+    {
+      analogWrite(_channelPin[i], wanted[i]); //Set the output pin of the channel at val
+      _channelValue[i] = wanted[i];
+      _channelTime[i] = millis();
+    }
+  }
+
+  return;
+}
+
+void DomoS::AddressTarget()
+/*	Set the addressing lines to the current target of the actuation in progress
+ 	and start waiting for the spread of signals
+ */
+{
+  SetAddressing(_actuation[_firstActuation].target[_currentTarget]); //Set the addressing line
+  _addressedChannel = _actuation[_firstActuation].channel[_currentTarget];
+
+  _actuationTime = millis();
+  _settling = true;
+
+  return;
+}
+
+void DomoS::Exit()
+/*	Act the exit from the system
+ 	
+ 	Debugged: Don't need to be debugged
+ */
+{
+  //Finish turning the queued peripheral before going off
+  while (_numActuation > 0)
+  {
+    Actuate();
+    delay(1); //Actuate never waits, the next state is at least a millisecond later
+  }
+
+  CommitStorage(); //Don't lose the changes still in memory
+
+  _on = false;
+  PrintPhrase(9);
+  Serial.end();
+
+  return;
+}
+
+byte DomoS::SearchPeripheralByName(char peripheral[])
+/*	Search the peripheral by name
+ 	The function return the index of the peripheral or -1 if not found
+ 	At first compare the fingerprint of the name whit the name index, only if they are equal
+ 	read the name from the storage for being sure it isn't a collision
+ 	
+ 	Debugged: OK
+ */
+{
+  boolean find;
+  byte i;
+  unsigned int hash;
+  char name[MAXNAMELEN];
+
+  hash = HashName(peripheral);
+
+  find = false; //Assume we don't find the peripheral
+  //Cycle until we find the peripheral or the peripherals are finished
+  i = 0;
+  while ((i < _numSlot) && (!find))
+  {
+    if (_snapshot.nameIndex[i] == hash) //Check if the fingerprints are equal, the free slots have 0
+    {
+      GetPeripheralName(i, name); //Get the name of the i-th peripheral
+
+      if (strcmp(peripheral, name) == 0) //Check if the name are equal
+        find = true; //We find the peripheral
+      else
+        i++; //Only a collision, go ahead
+    }
+    else
+      i++; //Go ahead
+  }
+
+  if (!find) //if the peripheral wasn't find set an error
+    i = -1;
+
+  return i;
+}
+
+unsigned int DomoS::HashName(const char name[])
+/*	Compute a 16 bit fingerprint of a peripheral name
+ 	Stop at the string terminator or after MAXNAMELEN character, like the name stored in the storage
+ */
+{
+  unsigned int hash;
+  byte i;
+
+  hash = 5381;
+  for (i = 0; (i < MAXNAMELEN) && (name[i] != '\0'); i++)
+    hash = ((hash << 5) + hash) ^ (byte)name[i]; //Same as hash * 33 ^ character
+
+  if (hash == 0) //0 is reserved for the free slots
+    hash = 1;
+
+  return hash;
+}
+
+void DomoS::BuildIndex()
+/*	Read once all the slots of the table for counting the peripherals and filling the name
+ 	index and the number bitmap, and for finding how many slots are sorted by number
+ 	If the number map is used it's checked and rebuilt here
+ 	Called only at startup, after that Create, Delete and CompactTable keep everything updated
+ 	If CompactTable was interrupted a peripheral can be present twice, in this case only the first
+ 	is kept
+ */
+{
+  byte i;
+  byte number;
+  byte lastNumber; //The number of the last peripheral of the sorted part
+  boolean sorted; //True until a peripheral out of order is found
+  char name[MAXNAMELEN];
+
+  memset(_snapshot.usedNumber, 0, sizeof(_snapshot.usedNumber)); //No number is used
+  _numPeripheral = 0;
+  _numSlot = 0;
+  _numSorted = 0;
+  lastNumber = 0;
+  sorted = true;
+
+  for (i = 0; i < _maxSlot; i++)
+  {
+    GetPeripheralNumber(i, number);
+
+    if ((number != 0) && (IsNumberUsed(number))) //A copy left by an interrupted CompactTable
+      ErasePeripheral(i);
+    else if (number != 0)
+    {
+      if (_numberMap) //Fix the number map, only the wrong cells are written
+        WriteStorage(NumberMapAddress(number), i);
+
+      GetPeripheralName(i, name);
+      _snapshot.nameIndex[i] = HashName(name);
+      MarkNumber(number, true);
+
+      _numPeripheral++;
+      _numSlot = i + 1; //The table ends after the last used slot
+
+      if (sorted && (number > lastNumber)) //The sorted part ends at the first peripheral out of order
+      {
+        lastNumber = number;
+        _numSorted = i + 1;
+      }
+      else
+        sorted = false;
+    }
+    else
+      _snapshot.nameIndex[i] = 0; //A free slot
+  }
+
+  if (_numberMap) //The numbers without a peripheral haven't a slot
+    for (i = 1; i != 0; i++)
+      if (!IsNumberUsed(i))
+        WriteStorage(NumberMapAddress(i), NOSLOT);
+
+  return;
+}
+
+boolean DomoS::IsNumberUsed(byte number)
+/*	Tell if the number is already used by a peripheral
+ */
+{
+  return ((_snapshot.usedNumber[number >> 3] & (1 << (number & 7))) != 0);
+}
+
+void DomoS::MarkNumber(byte number, boolean used)
+/*	Set the bit of number in the number bitmap if used is true, else clear it
+ */
+{
+  if (used)
+    _snapshot.usedNumber[number >> 3] |= (1 << (number & 7));
+  else
+    _snapshot.usedNumber[number >> 3] &= ~(1 << (number & 7));
+
+  return;
+}
+
+byte DomoS::SearchFreeNumber(byte number)
+/*	Search the first free number starting from number and going ahead
+ 	When the numbers allowed by the address pins are finished start again from 1, zero isn't allowed
+ 	Return 0 if all the numbers are used
+ */
+{
+  int i;
+  int maxNumber; //The number of peripheral the address pins can handle
+
+  maxNumber = (1 << _numAddressPin) - 1;
+
+  i = 0;
+  //Cycle until all the allowed number are checked or a free number was found
+  while ((i < maxNumber) && (IsNumberUsed(number)))
+  {
+    number = ((number + 1) % (maxNumber + 1));
+    if(number == 0)
+      number++;
+    i++;
+  }
+
+  if (i == maxNumber) //No free number was found
+    number = 0;
+
+  return number;
+}
+
+byte DomoS::SearchFreeSlot(byte number)
+/*	Search the slot where a new peripheral whit this number can be written
+ 	The peripherals are written after the last used slot, so the writings are spread over all
+ 	the storage, when the end of the table is reached the table is compacted
+ 	If less than MAXHOLES slots are free the compaction would move many peripherals for a single
+ 	new one, so a free slot is used: one where the sorted slots stay in order, or one after them,
+ 	otherwise the first one
+ 	Return -1 and set an error if the table is full
+ */
+{
+  byte position;
+  byte i;
+
+  if ((_numSlot >= _maxSlot) && (_numPeripheral + MAXHOLES <= _maxSlot)) //The end of the table was reached
+    CompactTable();
+
+  if (_numSlot < _maxSlot)
+    position = _numSlot;
+  else
+  {
+    position = -1;
+    for (i = 0; (i < _numSlot) && (position == (byte)-1); i++)
+      if ((_snapshot.nameIndex[i] == 0) && ((i >= _numSorted) || (KeepsOrder(i, number))))
+        position = i;
+
+    for (i = 0; (i < _numSlot) && (position == (byte)-1); i++)
+      if (_snapshot.nameIndex[i] == 0)
+        position = i;
+
+    if (position == (byte)-1)
+      _lastError = EEPROMISFULL;
+  }
+
+  return position;
+}
+
+void DomoS::CompactTable()
+/*	Sort all the peripherals by number at the start of the table, removing the free slots between them
+ 	The slots left free at the end of the table can be used again by SearchFreeSlot
+ */
+{
+  _compacting = false; //Always start from the first number
+
+  while (!CompactStep());
+
+  return;
+}
+
+boolean DomoS::CompactStep()
+/*	Do a single step of the compaction, that puts every peripheral in the slot given by the rank
+ 	of its number, found using the number bitmap
+ 	The next slot to be sorted gets the peripheral with the next number; if it contains another
+ 	peripheral, the chain of the peripherals standing in the slot of another one is followed
+ 	until one whose slot is free, and that one is moved: so a peripheral is moved only once,
+ 	directly in its place
+ 	Only if the chain comes back to the slot to be sorted, one of its peripherals is moved in a
+ 	free slot before, breaking the chain
+ 	Every move first writes the copy then frees the original, so if the power goes off in the middle
+ 	BuildIndex will find the same peripheral twice and keep only the first
+ 	Return true when the table is sorted and compact
+ 	If there isn't a free slot for moving a peripheral, the table is left sorted only in part
+ */
+{
+  boolean done;
+  boolean closed; //True if the chain comes back to the slot to be sorted
+  byte position; //The free slot at the end of the chain
+  byte from; //The slot of the peripheral to be moved in position
+  byte free;
+  byte number;
+
+  done = false;
+
+  if (!_compacting) //Start a new compaction
+  {
+    _compacting = true;
+    _compactNumber = 1;
+    _compactPosition = 0;
+  }
+
+  //Search the next used number
+  while ((_compactNumber < 256) && (!IsNumberUsed(_compactNumber)))
+    _compactNumber++;
+
+  if (_compactNumber == 256) //All the peripherals are in their place
+  {
+    _snapshot.check = 0; //The counters are changing
+    _numSlot = _compactPosition;
+    _numSorted = _compactPosition;
+    _compacting = false;
+    done = true;
+  }
+  else
+  {
+    from = SearchPeripheralByNumber(_compactNumber);
+    position = _compactPosition;
+    closed = false;
+
+    if (from != _compactPosition)
+    {
+      //Every peripheral of the chain has a bigger number, so its place is after the slot to be sorted
+      while ((_snapshot.nameIndex[position] != 0) && (!closed))
+      {
+        GetPeripheralNumber(position, number);
+        if (number == _compactNumber) //Its place is the slot to be sorted, where the chain started
+          closed = true;
+        else
+        {
+          from = position;
+          position = NumberRank(number);
+        }
+      }
+
+      if (!closed)
+        MovePeripheral(from, position);
+      else
+      {
+        //Search a free slot, better if it isn't the place of a peripheral
+        for (free = _numPeripheral; (free < _maxSlot) && (_snapshot.nameIndex[free] != 0); free++);
+        if (free == _maxSlot)
+          for (free = _compactPosition + 1; (free < _maxSlot) && (_snapshot.nameIndex[free] != 0); free++);
+
+        if (free < _maxSlot)
+        {
+          MovePeripheral(_compactPosition, free);
+          if (free >= _numSlot)
+            _numSlot = free + 1;
+        }
+        else //The table is full, can't go ahead
+        {
+          _compacting = false;
+          done = true;
+        }
+      }
+    }
+
+    if ((!done) && (!closed) && (position == _compactPosition)) //The slot to be sorted has its peripheral
+    {
+      _compactPosition++;
+      _numSorted = _compactPosition; //Only the slots before are surely sorted
+      _compactNumber++;
+    }
+  }
+
+  return done;
+}
+
+byte DomoS::NumberRank(byte number)
+/*	Return how many used numbers are smaller than number, that is the slot of its peripheral
+ 	when the table is sorted and compact
+ */
+{
+  byte rank;
+  int i;
+
+  rank = 0;
+  for (i = 1; i < number; i++)
+    if (IsNumberUsed(i))
+      rank++;
+
+  return rank;
+}
+
+void DomoS::MovePeripheral(byte from, byte to)
+/*	Copy a peripheral in a free slot, then free its old slot
+ */
+{
+  DomoSFileBody peripheral;
+
+  GetPeripheralName(from, peripheral.name);
+  GetPeripheralNumber(from, peripheral.number);
+  GetPeripheralChannel(from, peripheral.channel);
+
+  WritePeripheral(peripheral, to);
+  ErasePeripheral(from);
+
+  return;
+}
+
+boolean DomoS::KeepsOrder(byte position, byte number)
+/*	Tell if a peripheral with this number written in position is still sorted, that is if the
+ 	peripheral before it has a smaller number and the next one of the sorted slots a bigger one
+ */
+{
+  byte previous, next;
+  byte previousNumber, nextNumber;
+
+  //Skip the free slots before and after position
+  for (previous = position; (previous > 0) && (_snapshot.nameIndex[previous - 1] == 0); previous--);
+  for (next = position + 1; (next < _numSorted) && (_snapshot.nameIndex[next] == 0); next++);
+
+  previousNumber = 0; //The first peripheral is always sorted
+  if (previous > 0)
+    GetPeripheralNumber(previous - 1, previousNumber);
+
+  nextNumber = 255; //And also the last one
+  if (next < _numSorted)
+    GetPeripheralNumber(next, nextNumber);
+
+  return (previousNumber < number) && ((next >= _numSorted) || (number < nextNumber));
+}
+
+void DomoS::ErasePeripheral(byte position)
+/*	Mark the slot of a peripheral as free writing 0 as its number
+ 	Only one cell is written, the name is left there
+ */
+{
+  byte number;
+
+  if (_numberMap) //Remove the slot from the number map, if the number wasn't already moved
+  {
+    GetPeripheralNumber(position, number);
+    if ((number != 0) && (ReadStorage(NumberMapAddress(number)) == position))
+      WriteStorage(NumberMapAddress(number), NOSLOT);
+  }
+
+  WriteStorage(PeripheralAddress(position) + PACKEDNAMELEN, 0);
+  _snapshot.nameIndex[position] = 0;
+
+  return;
+}
+
+int DomoS::NumberMapAddress(byte number)
+/*	Return the address of the cell of the number map containing the slot of number
+ 	The map is after the last cell the table can ever use
+ */
+{
+  return PeripheralAddress(MAXPERIPHERAL) + number;
+}
+
+int DomoS::PeripheralAddress(byte position)
+/*	Return the address of the first cell of a slot
+ 	2 = the first two cells are occupied by the setup values
+ 	sizeof(DomoSFileHeader) = the next cells are occupied by the configuration parameters
+ 	then there're position slots big sizeof(DomoSFileRecord)
+ */
+{
+  return START + sizeof(DomoSFileHeader) + (sizeof(DomoSFileRecord) * position);
+}
+
+void DomoS::MigrateFile()
+/*	Bring a file written by an older DomoS to the current version
+ 	
+ 	Version 0 -> 1: the first numPeripheral slots are used, but the slots after them can contain
+ 	old peripherals left by Delete, so mark them as free
+ 	Version 1 -> 2: the slots shrink from 11 to 8 byte packing the names, the i-th new slot
+ 	always ends before the (i+1)-th old slot, so the slots are converted in place going ahead
+ 	Then all the new slots after the old ones are marked as free
+ 	The character not in the charset become '_', so two names can become the same: the second
+ 	one takes the standard name, as Create does, and it's printed
+ 	Version 2 -> 3: there's a single output channel, and all the peripherals are already on it
+ 	Version 3 -> 4: the CRC of the header is written
+ */
+{
+  int oldSlot; //Number of the old slots containing peripherals
+  int i;
+  int j;
+  int peripheral;
+  DomoSFileBody body;
+  boolean numberMap;
+  boolean duplicated;
+  char name[MAXNAMELEN];
+
+  //The number map can be over the old slots not yet converted, BuildIndex will rebuild it
+  numberMap = _numberMap;
+  _numberMap = false;
+
+  if (_fileVer < 2)
+  {
+    if (_fileVer == 0)
+      oldSlot = (_numPeripheral < OLDMAXPERIPHERAL) ? _numPeripheral : OLDMAXPERIPHERAL;
+    else
+      oldSlot = OLDMAXPERIPHERAL;
+
+    for (i = 0; i < _maxSlot; i++)
+    {
+      peripheral = PeripheralAddress(0) + (OLDRECORDSIZE * i);
+
+      if (i < oldSlot)
+        ReadStorage(peripheral, (byte*)&body, OLDRECORDSIZE); //The name and the number
+      else
+        body.number = 0;
+      body.channel = 0;
+
+      if (body.number != 0)
+      {
+        body.name[MAXNAMELEN - 1] = '\0';
+
+        WritePeripheral(body, i); //The not allowed character become '_'
+
+        //Search the converted name between the ones already converted, the name index isn't
+        //built yet so it's filled here
+        GetPeripheralName(i, name);
+        _snapshot.nameIndex[i] = HashName(name);
+        duplicated = false;
+        for (j = 0; (j < i) && (!duplicated); j++)
+        {
+          if (_snapshot.nameIndex[j] == _snapshot.nameIndex[i])
+          {
+            GetPeripheralName(j, body.name);
+            duplicated = (strcmp(body.name, name) == 0);
+          }
+        }
+
+        if (duplicated)
+        {
+          itoa((int)body.number, body.name, 10); //The standard name
+          WritePeripheral(body, i);
+
+          Serial.print((const __FlashStringHelper*)pgm_read_ptr(&PHRASE[18]));
+          Serial.println(body.name);
+        }
+      }
+      else
+        ErasePeripheral(i);
+    }
+
+    _fileVer = 2;
+  }
+
+  if (_fileVer < 3) //The cell of the number of peripherals contains the number of channels
+  {
+    _numChannel = 1;
+    WriteStorage(START + 1, _numChannel);
+    _fileVer = 3;
+  }
+
+  _fileVer = FILEVER; //Version 3 -> 4: only the CRC of the header is added
+  WriteStorage(START, _fileVer); //The version is the first cell of the header
+  UpdateHeaderCrc();
+
+  _numberMap = numberMap;
+
+  return;
+}
 
 void DomoS::GetPeripheralName(byte numPeripheral, char name[])
 /*	Put into char name[] the name of the numPeripheral-th peripheral
+ 	If the stored name is empty the peripheral has the standard name, that is its number
  	
  	Debugged: Ok
  	Modify the second sizeof for calculate the size of the correct structure
  */
 {
   int peripheral;
-  DomoSFileBody body;
-  DomoSFileHeader configuration;
-  byte i;
+  byte packed[PACKEDNAMELEN];
+  byte number;
 
-  //The numPeripheral-th peripheral is stored from the address described by this formula
-  //2 = the first two cells are occupied by the setup values
-  //sizeof(configuration) = the next cells are occupied by the configuration parameters
-  //In the EEPROM there're numPeripheral peripheral big sizeof(peripheral), so go ahead
-  //for all this peripheral
-  peripheral = 2 + sizeof(configuration) + (sizeof(body) * numPeripheral);
+  peripheral = PeripheralAddress(numPeripheral);
 
-  for (i = 0; i < MAXNAMELEN; i++)
-    name[i] = EEPROM.read(peripheral + i);
+  ReadStorage(peripheral, packed, PACKEDNAMELEN);
+  if ((packed[0] >> 2) == 0) //The first character is the end of the name
+  {
+    GetPeripheralNumber(numPeripheral, number);
+    itoa((int)number, name, 10);
+  }
+  else
+    UnpackName(packed, name);
 
   return;
 }
@@ -1094,7 +2618,7 @@ boolean DomoS::SearchDuplicatedPeripheral(DomoSFileBody & peripheral, boolean na
 
   if ((numberCustom) && (!error)) //Check if the user set a number and there aren't errors
   {
-    if (SearchPeripheralByNumber(peripheral.number) != (byte)-1) //Check if the user's number is already present
+    if (IsNumberUsed(peripheral.number)) //Check if the user's number is already present
     {
       _lastError = PERIPHERALNUMBERNOTUNIQUE;
       error = true;
@@ -1120,20 +2644,11 @@ boolean DomoS::SearchDuplicatedPeripheral(DomoSFileBody & peripheral, boolean na
     }
   }
 
-  if ((!numberCustom) && (!error))
-  {
-    i = 0;
-    //Cycle until the allowed number are finished (a bit strange, but i think can happen) or 
-    //a free number was found
-    while ((i < ((1 << _numAddressPin) - 1)) && (SearchPeripheralByNumber(peripheral.number) != (byte)-1))
-    {
-      peripheral.number = ((peripheral.number + 1) % (1 << _numAddressPin));
-      if(peripheral.number == 0)
-        peripheral.number++;
-      i++;
-    }
+  if ((!numberCustom) && (!error))
+  {
+    peripheral.number = SearchFreeNumber(peripheral.number);
 
-    if (i == ((1 << _numAddressPin) - 1)) //Check if no available number was found
+    if (peripheral.number == 0) //Check if no available number was found
     {
       error = true;
       _lastError = CANTFINDFREENUMBER; 
@@ -1145,6 +2660,9 @@ boolean DomoS::SearchDuplicatedPeripheral(DomoSFileBody & peripheral, boolean na
 
 byte DomoS::SearchPeripheralByNumber(byte peripheral)
 /*	Search the peripheral by number
+ 	If there's the number map read the slot from it, else (or if the map is wrong)
+ 	search it with a binary search into the sorted part of the table, then go ahead
+ 	reading one by one the few peripherals created after the last compaction
  	The function return the index of the peripheral or -1 if not found
  	
  	Debugged: OK
@@ -1152,16 +2670,55 @@ byte DomoS::SearchPeripheralByNumber(byte peripheral)
 {
   boolean find;
   byte i;
+  byte low, high; //The sorted slots still to be checked are from low to high - 1
+  byte middle;
   byte number;
 
   find = false; //Assume we don't find the peripheral
+
+  if (_numberMap && IsNumberUsed(peripheral)) //The number map tells directly the slot
+  {
+    i = ReadStorage(NumberMapAddress(peripheral));
+    if ((i < _numSlot) && (_snapshot.nameIndex[i] != 0))
+    {
+      GetPeripheralNumber(i, number); //Only one cell for being sure the map is right
+      find = (number == peripheral);
+    }
+  }
+
+  //If the number isn't in the bitmap don't even start reading the storage
+  low = 0;
+  high = ((IsNumberUsed(peripheral) && (!find)) ? _numSorted : 0);
+  while ((low < high) && (!find))
+  {
+    middle = (low + high) / 2;
+
+    //The free slots don't have a number, use the first peripheral after middle
+    for (i = middle; (i < high) && (_snapshot.nameIndex[i] == 0); i++);
+
+    if (i == high) //Only free slots from middle to high
+      high = middle;
+    else
+    {
+      GetPeripheralNumber(i, number);
+
+      if (peripheral == number)
+        find = true; //We find the peripheral
+      else if (number < peripheral)
+        low = i + 1;
+      else
+        high = middle;
+    }
+  }
+
   //Cycle until we find the peripheral or the peripherals are finished
-  i = 0;
-  while ((i < _numPeripheral) && (!find))
+  if (!find)
+    i = (IsNumberUsed(peripheral) ? _numSorted : _numSlot);
+  while ((i < _numSlot) && (!find))
   {
-    GetPeripheralNumber(i, number); //Get the name of the i-th peripheral
+    GetPeripheralNumber(i, number); //Get the number of the i-th peripheral
 
-    if (peripheral == number) //Check if the name are equal
+    if (peripheral == number) //Check if the number are equal
       find = true; //We find the peripheral
     else
       i++; //Go ahead
@@ -1174,26 +2731,24 @@ byte DomoS::SearchPeripheralByNumber(byte peripheral)
 }
 
 void DomoS::GetPeripheralNumber(byte numPeripheral, byte & number)
-/*	Put into char name[] the name of the numPeripheral-th peripheral
+/*	Put into number the number of the numPeripheral-th peripheral
  	
  	Debugged: Ok
  	Modify the second sizeof for calculate the size of the correct structure
  */
 {
-  int peripheral;
-  DomoSFileBody body;
-  DomoSFileHeader configuration;
-  byte i;
+  //Before the number thare're the name of the peripheral, so go ahead of PACKEDNAMELEN cells
+  number = ReadStorage(PeripheralAddress(numPeripheral) + PACKEDNAMELEN);
 
-  //The numPeripheral-th peripheral is stored from the address described by this formula
-  //2 = the first two cells are occupied by the setup values
-  //sizeof(configuration) = the next cells are occupied by the configuration parameters
-  //In the EEPROM there're numPeripheral peripheral big sizeof(peripheral), so go ahead
-  //for all this peripheral
-  //Before the number thare're the name of the peripheral, so go ahead of MAXNAMELEN cells
-  peripheral = 2 + sizeof(configuration) + (sizeof(body) * numPeripheral) + MAXNAMELEN;
+  return;
+}
 
-  number = EEPROM.read(peripheral);
+void DomoS::GetPeripheralChannel(byte numPeripheral, byte & channel)
+/*	Put into channel the output channel of the numPeripheral-th peripheral
+ 	The channel is in the last two bits of the packed name
+ */
+{
+  channel = ReadStorage(PeripheralAddress(numPeripheral) + PACKEDNAMELEN - 1) & CHANNELMASK;
 
   return;
 }
@@ -1204,108 +2759,31 @@ void DomoS::ThrownError()
  	Debugged: Don't need to be debugged
  */
 {
-  //Get the error
-  switch (GetError())
-    //Give a little description
-  {
-  case COMMANDSTRINGTOOLONG:
-    Serial.println(ERROR[COMMANDSTRINGTOOLONG]);
-    break;
-
-  case SUBCOMMANDSTRINGTOOLONG:
-    Serial.println(ERROR[SUBCOMMANDSTRINGTOOLONG]);
-    break;
-
-  case COMMANDNOTRECOGNIZED:
-    Serial.println(ERROR[COMMANDNOTRECOGNIZED]);
-    break;
-
-  case NOCOMMANDPARAMETERS:
-    Serial.println(ERROR[NOCOMMANDPARAMETERS]);
-    break;
-
-  case SUBCOMMANDNOTRECOGNIZED:
-    Serial.println(ERROR[SUBCOMMANDNOTRECOGNIZED]);
-    break;
-
-  case NAMENOTDEFINED:
-    Serial.println(ERROR[NAMENOTDEFINED]);
-    break;
-
-  case NAMETOOLONG:
-    Serial.println(ERROR[NAMETOOLONG]);
-    break;
-
-  case ASNOTDEFINED:
-    Serial.println(ERROR[ASNOTDEFINED]);
-    break;
-
-  case BINARYNUMBERTOOLONG:
-    Serial.println(ERROR[BINARYNUMBERTOOLONG]);
-    break;
-
-  case EEPROMISFULL:
-    Serial.println(ERROR[EEPROMISFULL]);
-    break;
-
-  case PERIPHERALNOTFOUND:
-    Serial.println(ERROR[PERIPHERALNOTFOUND]);
-    break;
-
-  case STRANGETURNPARAMETER:
-    Serial.println(ERROR[STRANGETURNPARAMETER]);
-    break;
-
-  case BADTHINGSHAPPEN:
-    Serial.println(ERROR[BADTHINGSHAPPEN]);
-    break;
-
-  case PERIPHERALZERONOTALLOWED:
-    Serial.println(ERROR[PERIPHERALZERONOTALLOWED]);
-    break;
-
-  case PERIPHERALMAXIMUMNUMBERREACH:
-    Serial.println(ERROR[PERIPHERALMAXIMUMNUMBERREACH]);
-    break;
-
-  case PERIPHERALNAMENOTUNIQUE:
-    Serial.println(ERROR[PERIPHERALNAMENOTUNIQUE]);
-    break;
-
-  case PERIPHERALNUMBERNOTUNIQUE:
-    Serial.println(ERROR[PERIPHERALNUMBERNOTUNIQUE]);
-    break;
-
-  case CANTFINDFREENAME:
-    Serial.println(ERROR[CANTFINDFREENAME]);
-    break;
-
-  case CANTFINDFREENUMBER:
-    Serial.println(ERROR[CANTFINDFREENUMBER]);
-    break;
-
-  case VOLTAGETOOLOW:
-    Serial.println(ERROR[VOLTAGETOOLOW]);
-    break;
+  //Give a little description of the error
+  if (GetError() < NERROR)
+    PrintError(GetError());
+  else
+    PrintError(BADTHINGSHAPPEN);
 
-  case VOLTAGETOOHIGH:
-    Serial.println(ERROR[VOLTAGETOOHIGH]);
-    break;
+  _lastError = OK;
 
-  case DECIMALNUMBERTOOBIG:
-    Serial.println(ERROR[DECIMALNUMBERTOOBIG]);
-    break;
+  return;
+}
 
-  case THEREAREZEROPERIPHERAL:
-    Serial.println(ERROR[THEREAREZEROPERIPHERAL]);
-    break;
+void DomoS::PrintPhrase(byte phrase)
+/*	Print on the serial port a phrase reading it directly from the flash memory
+ */
+{
+  Serial.println((const __FlashStringHelper*)pgm_read_ptr(&PHRASE[phrase]));
 
-  default:
-    Serial.println(ERROR[BADTHINGSHAPPEN]);
-    break;
-  }
+  return;
+}
 
-  _lastError = OK;
+void DomoS::PrintError(byte error)
+/*	Print on the serial port the description of an error reading it directly from the flash memory
+ */
+{
+  Serial.println((const __FlashStringHelper*)pgm_read_ptr(&ERROR[error]));
 
   return;
 }
@@ -1319,11 +2797,13 @@ byte DomoS::GetError()
   return _lastError;
 }
 
-byte DomoS::ConvertBinaryStringToDecimal()
-/*	Convert the _subCommand string from binary to decimal
+byte DomoS::ConvertBinaryStringToDecimal(char binary[])
+/*	Convert the binary string from binary to decimal
+ 	The first character is the most significant addressing line, missing character are 0
  	
  	Debugged: OK
  	Corrected some typos [base/2 -> base = base/2], [_subCommand[i] == 1 -> == '1']
+ 	Stop at the string terminator, after it there's the next word of the command
  */
 {
   byte base;
@@ -1332,8 +2812,8 @@ byte DomoS::ConvertBinaryStringToDecimal()
 
   base = 1 << (_numAddressPin - 1);
 
-  for (i = 0, number = 0; i < _numAddressPin; i++, base = base/2)
-    if (_subCommand[i] == '1')
+  for (i = 0, number = 0; (i < _numAddressPin) && (binary[i] != '\0'); i++, base = base/2)
+    if (binary[i] == '1')
       number += base;
 
   return number;
@@ -1349,13 +2829,32 @@ boolean DomoS::IsOn()
 }
 
 void DomoS::Reset()
-/*
+/*	Act the reset command
+ 	Delete the setup values, so at the next start DomoS asks again the configuration
+ 	Whit the wipe option start also clearing all the storage, it's done by Work when idle
 */
 {
-  EEPROM.write(0,0);
-  EEPROM.write(1,0);
+  char* token;
+  byte readChar;
+
+  readChar = NextToken(token);
+  if ((readChar == 0) || (CompareKeyword(token, readChar, &WIPEOPTION)))
+  {
+    WriteStorage(0,0);
+    WriteStorage(1,0);
+    CommitStorage(); //The user is going to reset the arduino, write everything now
 
-  Serial.println(PHRASE[8]);
+    if (readChar == 0)
+      PrintPhrase(8);
+    else
+    {
+      _wiping = true;
+      _wipePosition = 0;
+      _wipeProgress = 0;
+    }
+  }
+  else
+    _lastError = SUBCOMMANDNOTRECOGNIZED;
 
   return;
 }
@@ -1367,13 +2866,17 @@ void DomoS::ComposeStringPeripheral(DomoSFileBody peripheral, byte phrase)
   char output[82];
   char buff[9];
   byte i, j, k;
+  const char* text; //The phrase in the flash memory
+  char c;
 
   i = 0; 
   j = 0; 
   k = 0;
-  while (PHRASE[phrase][i] != '\0')
+  text = (const char*)pgm_read_ptr(&PHRASE[phrase]);
+  c = pgm_read_byte(text);
+  while (c != '\0')
   {
-    switch (PHRASE[phrase][i])
+    switch (c)
     {
     case 'N':
       k = 0;
@@ -1396,6 +2899,11 @@ void DomoS::ComposeStringPeripheral(DomoSFileBody peripheral, byte phrase)
       }
       break;
 
+    case 'C':
+      output[j] = '0' + peripheral.channel;
+      j++;
+      break;
+
     case 'B':
       itoa(peripheral.number, buff, 2);
       k = 0;
@@ -1408,12 +2916,13 @@ void DomoS::ComposeStringPeripheral(DomoSFileBody peripheral, byte phrase)
       break;
 
     default:
-      output[j] = PHRASE[phrase][i];
+      output[j] = c;
       j++;
       break;
     }
 
     i++;
+    c = pgm_read_byte(text + i);
   }
   output[j] = '\0';
 
@@ -1429,15 +2938,19 @@ void DomoS::List()
   byte i;
   DomoSFileBody peripheral;
 
-  for(i = 0; i < _numPeripheral; i++)
+  for(i = 0; i < _numSlot; i++)
   {
-    GetPeripheralName(i, peripheral.name);
-    GetPeripheralNumber(i, peripheral.number);
+    if (_snapshot.nameIndex[i] != 0) //Skip the deleted peripherals
+    {
+      GetPeripheralName(i, peripheral.name);
+      GetPeripheralNumber(i, peripheral.number);
+      GetPeripheralChannel(i, peripheral.channel);
 
-    ComposeStringPeripheral(peripheral, 10);
+      ComposeStringPeripheral(peripheral, 10);
+    }
   }
 
-  if(i == 0)
+  if(_numPeripheral == 0)
     _lastError = THEREAREZEROPERIPHERAL;
 
   return;
@@ -1448,27 +2961,461 @@ void DomoS::Delete()
 */
 {
   byte position;
-  DomoSFileBody newPeripheral;
+  char* token;
 
-  SeparateCommandBySpace();
+  NextToken(token);
 
-  position = SearchPeripheralByName(_subCommand);
+  position = SearchPeripheralByName(token);
   if (position != (byte)-1)
   {
-    if (position < (_numPeripheral - 1))
+    DeletePeripheral(position);
+    PrintPhrase(11);
+  }
+  else
+    _lastError = PERIPHERALNOTFOUND;
+
+  return;
+}
+
+void DomoS::DeletePeripheral(byte position)
+/*	Delete the peripheral in the slot position, shared by the delete command and the binary frames
+ */
+{
+  byte number;
+
+  GetPeripheralNumber(position, number);
+  MarkNumber(number, false); //The number of the deleted peripheral is free again
+
+  ErasePeripheral(position); //Only mark the slot as free, it will be reused by CompactTable or Create
+  UpdateNumPeripheral('-');
+  _compacting = false; //The table changed, a compaction in progress must start again
+
+  return;
+}
+
+void DomoS::Stats()
+/*	Act the stats command
+ 	Print on a single line, easy to be read by a program, the time spent by the previous
+ 	command and how many times it accessed the storage, then the storage accesses since the start
+ 	The writings of a command are the cells it changed, even if they're written later when idle
+ */
+{
+  DomoSKeyword keyword;
+
+  Serial.print(F("stats command="));
+  if (_lastCommand < NCOMMAND)
+  {
+    memcpy_P(&keyword, &COMMAND[_lastCommand].keyword, sizeof(keyword));
+    Serial.print((const __FlashStringHelper*)keyword.word);
+  }
+  else
+    Serial.print(F("none"));
+
+  Serial.print(F(" us="));
+  Serial.print(_lastCommandTime);
+  Serial.print(F(" reads="));
+  Serial.print(_lastCommandReads);
+  Serial.print(F(" writes="));
+  Serial.print(_lastCommandWrites);
+  Serial.print(F(" totalreads="));
+  Serial.print(_storageReads);
+  Serial.print(F(" totalwrites="));
+  Serial.print(_storageWrites);
+  Serial.print(F(" peripherals="));
+  Serial.print(_numPeripheral);
+  Serial.print(F(" capacity="));
+  Serial.print(_maxSlot);
+  Serial.print(F(" bootus="));
+  Serial.print(_bootTime);
+  Serial.print(F(" bootreads="));
+  Serial.print(_bootReads);
+  Serial.print(F(" warmboot="));
+  Serial.println(_warmBoot ? 1 : 0);
+
+  return;
+}
+
+void DomoS::Commit()
+/*	Act the commit and sync commands
+ */
+{
+  CommitStorage();
+
+  return;
+}
+
+void DomoS::Compact()
+/*	Act the compact command
+ 	Sort and compact now all the table, without waiting for Work to do it when idle
+ */
+{
+  CompactTable();
+
+  if (_numSorted == _numPeripheral)
+    PrintPhrase(12);
+  else //The table is full and it can't be sorted
+    _lastError = EEPROMISFULL;
+
+  return;
+}
+
+void DomoS::Export()
+/*	Act the export command
+ 	Print the stored records of IMPORTCHUNK peripherals at a time, as import commands whit the
+ 	CRC of the records, so the output can be sent to another DomoS for copying the table
+ 	The last line is a commit, for writing everything when the copy ends
+ */
+{
+  byte data[IMPORTCHUNK * sizeof(DomoSFileRecord) + 1]; //The records of a line and their CRC
+  DomoSFileRecord* record;
+  byte numRecord;
+  int i;
+
+  record = (DomoSFileRecord*)data;
+  numRecord = 0;
+  for (i = 0; i < _numSlot; i++)
+  {
+    if (_snapshot.nameIndex[i] != 0) //Skip the free slots
+    {
+      ReadStorage(PeripheralAddress(i), (byte*)&record[numRecord], sizeof(DomoSFileRecord));
+      numRecord++;
+    }
+
+    if ((numRecord == IMPORTCHUNK) || ((numRecord > 0) && (i == _numSlot - 1)))
+    {
+      data[numRecord * sizeof(DomoSFileRecord)] = Crc8(data, numRecord * sizeof(DomoSFileRecord));
+      Serial.print((const __FlashStringHelper*)IMPORTKEYWORD);
+      Serial.print(' ');
+      PrintHex(data, numRecord * sizeof(DomoSFileRecord) + 1);
+      Serial.println();
+      numRecord = 0;
+    }
+  }
+
+  Serial.println((const __FlashStringHelper*)COMMITKEYWORD);
+
+  return;
+}
+
+void DomoS::Import()
+/*	Act the import command
+ 	Check the CRC and all the records of the line, then write them at the end of the table
+ 	whit a single block, so they're written in a sequential run
+ 	If a record can't be added nothing is written
+ */
+{
+  byte data[IMPORTCHUNK * sizeof(DomoSFileRecord) + 1]; //The records of the line and their CRC
+  DomoSFileRecord* record;
+  char name[MAXNAMELEN];
+  char* token;
+  byte readChar;
+  byte numRecord;
+  byte i;
+
+  record = (DomoSFileRecord*)data;
+  readChar = NextToken(token);
+  numRecord = readChar / (2 * sizeof(DomoSFileRecord));
+
+  if ((numRecord == 0) || (numRecord > IMPORTCHUNK)
+    || (readChar != 2 * (numRecord * sizeof(DomoSFileRecord) + 1))
+    || (!HexToBytes(token, data, numRecord * sizeof(DomoSFileRecord) + 1))
+    || (data[numRecord * sizeof(DomoSFileRecord)] != Crc8(data, numRecord * sizeof(DomoSFileRecord))))
+    _lastError = IMPORTNOTVALID;
+  else if (CheckImport(record, numRecord))
+  {
+    if (_numSlot + numRecord > _maxSlot) //Make room at the end of the table
+      CompactTable();
+
+    if (_numSlot + numRecord <= _maxSlot)
+    {
+      WriteStorage(PeripheralAddress(_numSlot), data, numRecord * sizeof(DomoSFileRecord));
+
+      for (i = 0; i < numRecord; i++)
+      {
+        GetRecordName(record[i], name);
+        _snapshot.nameIndex[_numSlot] = HashName(name);
+        if (_numberMap)
+          WriteStorage(NumberMapAddress(record[i].number), _numSlot);
+
+        if ((_numSlot == _numSorted) && (KeepsOrder(_numSlot, record[i].number)))
+          _numSorted++; //Imported in order, the sorted part of the table grows
+        _numSlot++;
+        MarkNumber(record[i].number, true);
+        UpdateNumPeripheral('+');
+      }
+      _compacting = false; //The table changed, a compaction in progress must start again
+
+      PrintPhrase(17);
+    }
+    else
+      _lastError = EEPROMISFULL;
+  }
+
+  return;
+}
+
+boolean DomoS::CheckImport(DomoSFileRecord record[], byte numRecord)
+/*	Check that the imported records can be added to the table, setting the error if they can't
+ 	Every record is checked like a new peripheral of create, counting the records before it
+ 	The numbers are checked on the number bitmap and the names on the name index, so the table
+ 	isn't read, and every record is compared also whit the ones before it in the line
+ */
+{
+  DomoSFileBody peripheral;
+  char other[MAXNAMELEN];
+  byte i, j;
+
+  for (i = 0; (i < numRecord) && (_lastError == OK); i++)
+  {
+    GetRecordName(record[i], peripheral.name);
+    peripheral.number = record[i].number;
+    peripheral.channel = record[i].name[PACKEDNAMELEN - 1] & CHANNELMASK;
+
+    if (peripheral.number == 0)
+      _lastError = PERIPHERALZERONOTALLOWED;
+    else if (CheckNewPeripheral(peripheral, true, i))
+    {
+      if (IsNumberUsed(peripheral.number))
+        _lastError = PERIPHERALNUMBERNOTUNIQUE;
+      else if (SearchPeripheralByName(peripheral.name) != (byte)-1)
+        _lastError = PERIPHERALNAMENOTUNIQUE;
+    }
+
+    for (j = 0; (j < i) && (_lastError == OK); j++)
+    {
+      GetRecordName(record[j], other);
+      if (record[j].number == peripheral.number)
+        _lastError = PERIPHERALNUMBERNOTUNIQUE;
+      else if (strcmp(peripheral.name, other) == 0)
+        _lastError = PERIPHERALNAMENOTUNIQUE;
+    }
+  }
+
+  return (_lastError == OK);
+}
+
+void DomoS::PrintHex(const byte data[], byte length)
+/*	Print length bytes as two hex digit each, without spaces
+ */
+{
+  byte i;
+
+  for (i = 0; i < length; i++)
+  {
+    Serial.print((char)pgm_read_byte(&HEXDIGIT[data[i] >> 4]));
+    Serial.print((char)pgm_read_byte(&HEXDIGIT[data[i] & 0x0F]));
+  }
+
+  return;
+}
+
+boolean DomoS::HexToBytes(const char text[], byte data[], byte length)
+/*	Convert the first 2 * length hex digits of text into length bytes
+ 	The command is already lower case, so only the lower case digits are accepted
+ */
+{
+  boolean ok;
+  byte i;
+  byte digit;
+
+  ok = true;
+  for (i = 0; (i < 2 * length) && ok; i++)
+  {
+    if ((text[i] >= '0') && (text[i] <= '9'))
+      digit = text[i] - '0';
+    else if ((text[i] >= 'a') && (text[i] <= 'f'))
+      digit = text[i] - 'a' + 10;
+    else
+      ok = false;
+
+    if (ok) //The first digit is pushed in the high half by the second one
+      data[i >> 1] = (data[i >> 1] << 4) | digit;
+  }
+
+  return ok;
+}
+
+void DomoS::WipeStep()
+/*	Clear the next cell of the wipe in progress, counting the accesses
+ 	The cells are read and written directly, because all the EEPROM is cleared even when the
+ 	table is in the file; there're no dirty cells, Work writes them before
+ 	Every WIPESTEP percent the progress is printed, at the end the commands are still refused,
+ 	because the peripherals in memory aren't in the storage anymore
+ */
+{
+  int size; //The number of cells to be cleared
+  int address;
+  byte value;
+  byte progress;
+  DomoSStorage* storage;
+
+  size = E2END + 1;
+  if (_storage != &_eeprom)
+    size += _storage->Size() - PeripheralAddress(0);
+
+  if (_wipePosition < size) //When the wipe is complete DomoS stays still until the reset
+  {
+    if (_wipePosition <= E2END)
+    {
+      storage = &_eeprom;
+      address = _wipePosition;
+    }
+    else //After the EEPROM the file, its header is in the EEPROM
     {
-      GetPeripheralName(_numPeripheral - 1, newPeripheral.name);
-      GetPeripheralNumber(_numPeripheral - 1, newPeripheral.number);
+      storage = _storage;
+      address = _wipePosition - (E2END + 1) + PeripheralAddress(0);
+    }
+
+    _storageReads++;
+    storage->Read(address, &value, 1);
+    if (value != 0)
+    {
+      value = 0;
+      _storageWrites++;
+      storage->Write(address, &value, 1);
+    }
+    _wipePosition++;
 
-      WritePeripheral(newPeripheral, position);
+    progress = ((long)_wipePosition * 100) / size;
+    if (progress >= _wipeProgress + WIPESTEP)
+    {
+      _wipeProgress = progress - (progress % WIPESTEP);
+      Serial.print((const __FlashStringHelper*)pgm_read_ptr(&PHRASE[16]));
+      Serial.print(_wipeProgress);
+      Serial.println('%');
     }
-    UpdateNumPeripheral('-');
 
-    Serial.println(PHRASE[11]);
+    if (_wipePosition == size)
+    {
+      _storage->Sync();
+      PrintPhrase(8);
+    }
   }
+
+  return;
+}
+
+byte DomoS::ReadStorage(int address)
+/*	Read a cell of the storage counting the access
+ 	If the cell is waiting to be written return the value in memory
+ 	All the readings must be done by this function or by the block ReadStorage
+ */
+{
+  byte value;
+
+  ReadStorage(address, &value, 1);
+
+  return value;
+}
+
+void DomoS::ReadStorage(int address, byte data[], byte length)
+/*	Read length cells of the storage with a single block reading, counting the accesses
+ 	Then the cells waiting to be written are copied over the read ones, the oldest first so a
+ 	cell waiting more times gets its last value
+ 	The cells before the first slot are always in the EEPROM, the others in the selected storage
+ 	HEADERCRC is read alone, it's the last cell of the EEPROM
+ */
+{
+  byte i;
+
+  _storageReads += length;
+
+  if (address == HEADERCRC)
+    _eeprom.Read(E2END, data, length);
+  else if (address < PeripheralAddress(0))
+    _eeprom.Read(address, data, length);
   else
-    _lastError = PERIPHERALNOTFOUND;
+    _storage->Read(address, data, length);
+
+  for (i = 0; i < _numDirty; i++)
+    if ((_dirty[i].address >= address) && (_dirty[i].address < (address + length)))
+      data[_dirty[i].address - address] = _dirty[i].value;
+
+  return;
+}
+
+void DomoS::WriteStorage(int address, byte value)
+/*	Write a cell of the storage
+ 	The cell isn't written immediately, it's only put in the dirty cells and will be
+ 	written by FlushStorage when DomoS has nothing to do, or by CommitStorage
+ 	If the cell already contains value nothing is done
+ 	A cell already waiting is added again after the others, keeping also its old value: the
+ 	storage must go through the same values in the same order, or a power cut in the middle
+ 	could leave for example the name of a peripheral written in a slot still having the number
+ 	of the one moved away
+ 	All the writings must be done by this function or by the block WriteStorage
+ */
+{
+  if (ReadStorage(address) != value) //Skip the cells that doesn't change, the last waiting value included
+  {
+    if (_numDirty == MAXDIRTY) //No more space, write the oldest cell now
+      FlushStorage();
+
+    _dirty[_numDirty].address = address;
+    _dirty[_numDirty].value = value;
+    _numDirty++;
+    _queuedWrites++;
+    _snapshot.check = 0; //The storage is changing
+  }
+
+  return;
+}
+
+void DomoS::WriteStorage(int address, const byte data[], byte length)
+/*	Write length cells of the storage, each one is delayed like a single cell
+ */
+{
+  byte i;
+
+  for (i = 0; i < length; i++)
+    WriteStorage(address + i, data[i]);
+
+  return;
+}
+
+void DomoS::FlushStorage()
+/*	Write into the storage the oldest dirty cell, counting the access
+ 	The cells are written in the same order of WriteStorage calls
+ 	When the last cell is written the storage is synced, so the SD card writes all the
+ 	cells of its sector at once
+ */
+{
+  byte i;
+  byte value;
+  int address;
+  DomoSStorage* storage;
+
+  if (_numDirty > 0)
+  {
+    storage = (_dirty[0].address < PeripheralAddress(0)) ? &_eeprom : _storage;
+    address = (_dirty[0].address == HEADERCRC) ? E2END : _dirty[0].address;
+
+    //The value can be changed again to the one already in the storage
+    storage->Read(address, &value, 1);
+    if (value != _dirty[0].value)
+    {
+      _storageWrites++;
+      storage->Write(address, &_dirty[0].value, 1);
+    }
+
+    //Remove the cell from the dirty cells
+    _numDirty--;
+    for (i = 0; i < _numDirty; i++)
+      _dirty[i] = _dirty[i + 1];
+
+    if (_numDirty == 0)
+      _storage->Sync();
+  }
 
   return;
 }
 
+void DomoS::CommitStorage()
+/*	Write into the storage all the dirty cells
+ */
+{
+  while (_numDirty > 0)
+    FlushStorage();
+
+  return;
+}
@@ -1,17 +1,22 @@
 #ifndef DomoS_H
 
 #define DomoS_H
-#include <arduino.h>
+#include <Arduino.h>
+#include "DomoSStorage.h"
 
 class DomoS
 {
 private:
 
+  static const long BAUDRATE = 115200; //Speed of the serial port
   static const byte STRINGMAXLEN = 64; //Maximum length for the command string
-  static const byte SUBSTRINGMAXLEN = 16; //Maximum length for a single command
+  static const byte MAXTOKEN = STRINGMAXLEN / 2; //Maximum number of words in a command, every word is followed by a space
   static const byte MAXADDRESSPIN = 8; //Maximum number of adressing pin
+  static const byte SHIFTREGISTER = 0x80; //Added to the stored number of addressing pin when the addressing is done by shift registers
+  static const long SHIFTCLOCK = 8000000; //Clock of the SPI bus for the shift registers
   static const byte MAXNAMELEN = 10; //Maximum length for a peripheral name
-  static const byte FILEVER = 0; //The version of the file type
+  static const byte PACKEDNAMELEN = 7; //Length of a stored name, (MAXNAMELEN - 1) character of 6 bit
+  static const byte FILEVER = 4; //The version of the file type
 
   /*
    The DomoS setting file is made of two parts
@@ -20,11 +25,44 @@ private:
    2) The body of the file which contains all the settings for the different
    peripherals [for a explanation go to the declaration of the type]
    These are stored in sequential order
+
+   From version 1 the body is a table of slots written like a log:
+   - a new peripheral is always written in the slot after the last used one
+   - a deleted peripheral is only marked writing 0 as its number, 0 isn't an allowed number
+   - when the end of the table is reached the used slots are moved at the start (CompactTable)
+   - the compaction also sorts the peripherals by number, so the number is searched with a
+     binary search into the sorted slots and then one by one into the slots created after it
+   - when the end of the table is reached Work compacts it when idle, so a new peripheral rarely
+     waits for it, and the slots are rewritten only once for every pass over the table
+   - but a table almost full would be compacted at every delete, so until MAXHOLES slots are free
+     a new peripheral is written in a free slot, keeping the sorted slots in order if it can
+   - the number of peripheral isn't stored, it's counted at startup
+   So the writings are spread over all the EEPROM instead of always hitting the same cells
+
+   If the storage has room after the biggest possible table (ATmega1280/2560 EEPROM or the SD card)
+   there's also the number map: NUMBERMAPSIZE cells, the n-th is the slot of the peripheral with
+   number n, NOSLOT if there isn't. It's kept by WritePeripheral and ErasePeripheral and checked at
+   startup by BuildIndex, so finding a peripheral by number costs only two cells
+
+   From version 2 the names are packed 6 bit for character and the standard names (the number
+   of the peripheral) aren't stored, so a slot is 8 byte instead of 11
+
+   From version 3 there're up to MAXCHANNEL output channels, the last two bits of the packed name
+   are the channel of the peripheral and the header has the number of channels
+
+   From version 4 the last cell of the EEPROM contains the CRC of the header, checked at startup
+   It's addressed as HEADERCRC, so it's never confused with a cell of the file; a table in the
+   EEPROM never uses that cell
    
-   With version 0 the different arduino EEPROM can contain up to:
+   With version 0 and 1 the different arduino EEPROM can contain up to:
    ATmega168 and ATmega8 [512byte]:       45 peripherals
    ATmega328 [1024byte]:                  91 peripherals
    ATmega1280 and ATmega2560 [4096byte]: 371 peripherals
+   With version 2:
+   ATmega168 and ATmega8 [512byte]:       62 peripherals
+   ATmega328 [1024byte]:                 126 peripherals
+   ATmega1280 and ATmega2560 [4096byte]: 510 peripherals
+   But the address pins can't handle more than 255 peripherals, so only 255 slots are used
    */
   struct DomoSFileHeader //size 13byte
   {
@@ -35,98 +73,400 @@ private:
     //Version of the file type, in case of change through developement
     byte fileVer; //EEPROM 2
     //Copy of the configuration parameters
-    byte numPeripheral; //EEPROM 3
-    byte numAddressPin; //EEPROM 4
-    byte addressPin[MAXADDRESSPIN]; //EEPROM 5-12
-    byte outputPin; //EEPROM 13
+    byte numChannel; //EEPROM 3, the number of output channels, until version 2 the number of peripherals used only by version 0
+    byte numAddressPin; //EEPROM 4, plus SHIFTREGISTER if the addressing is done by shift registers
+    byte addressPin[MAXADDRESSPIN]; //EEPROM 5-12, with the shift registers only the latch pin
+    byte outputPin; //EEPROM 13, the pin of the channel 0
     byte writeToEeprom; //EEPROM 14
   };
 
-  struct DomoSFileBody //size 11byte
+  struct DomoSFileBody //size 11byte, a peripheral in memory, it was also the stored slot until version 1
   {
     char name[MAXNAMELEN]; //The name of the peripheral
     byte number; //The number of the peripheral and the addressing parameter
+    byte channel; //The output channel of the peripheral, not in the slot of version 0 and 1
+  };
+
+  struct DomoSFileRecord //size 8byte, a peripheral as stored in a slot
+  {
+    byte name[PACKEDNAMELEN]; //The name packed by PackName, all 0 for the standard name, then the channel in the last two bits
+    byte number; //The number of the peripheral, 0 for a free slot
+  };
+
+  static const byte MAXTARGET = 8; //Maximum number of peripheral turned by a single command
+  static const byte MAXCHANNEL = 4; //Maximum number of output channels
+  static const byte CHANNELMASK = MAXCHANNEL - 1; //The bits of the channel in the last byte of a packed name
+
+  struct DomoSActuation
+  {
+    byte value; //The value to be written on the output pin
+    byte numTarget; //The number of peripheral to be actuated
+    byte target[MAXTARGET]; //The numbers of the peripherals to be actuated
+    byte channel[MAXTARGET]; //The output channels of the peripherals to be actuated
+    byte reply; //How the end of the actuation is told: NOREPLY, TEXTREPLY or FRAMEREPLY
+    byte id; //The id of the command that queued the actuation
+  };
+
+  /*
+   The keywords understood by DomoS
+   For each keyword is stored also its length, so comparing a word with a keyword that
+   can't be it costs only one or two byte comparisons
+   */
+  struct DomoSKeyword
+  {
+    const char* word; //The keyword
+    byte length; //The length of the keyword
+  };
+
+  typedef void (DomoS::*DomoSAction)(); //A function executing a command
+
+  struct DomoSCommand
+  {
+    DomoSKeyword keyword; //The word calling the command
+    DomoSAction action; //The function executing the command
   };
 
   //Setup function
-  void GetConfigurationDataFromEeprom(); //Gets the configurations data from the EEPROM
+  boolean GetConfigurationDataFromEeprom(); //Gets the configurations data from the EEPROM, returns false if they're damaged
+  boolean IsOldHeader(const DomoSFileHeader & data); //Tells if data can be the header of a file of an older version
+  boolean LoadSnapshot(); //Gets the configuration and the indexes from the snapshot, returns false if it isn't valid
+  void SaveSnapshot(); //Saves the configuration and the indexes in the snapshot
+  void UpdateHeaderCrc(); //Writes the CRC of the header stored in the EEPROM
+  byte Crc8(const byte data[], int length); //Computes the CRC of a block of memory
   void FirstStart(); //Starts all the magic before the first start
   boolean CheckSetupData(); //Checks if the system has been already setupped
-  void ClearEeprom(); //Clears all the EEPROM
+  void ClearEeprom(); //Clears the EEPROM cells used by DomoS
   void WriteSetupData(); //Writes to the first two cells of EEPROM the setup check values
   void AskData(DomoSFileHeader & data); //Asks to the user the configuration parameters
+  boolean IsChannelPin(byte pin, byte numChannel); //Tells if pin is the output pin of a channel
   void WriteConfigurationDataToEeprom (DomoSFileHeader data); //Writes the data variables into the EEPROM
   void Initialize(); //Initializes the DomoS module
   void UpdateNumPeripheral(char type); //Updates the peripheral number
+  void MigrateFile(); //Brings a file of an older version to the current version
+  void OpenStorage(); //Chooses where the peripherals are stored
 
-  boolean ConvertDecimalToBinary(int number, boolean result[]); //Converts a decimal number to an array of boolean, return false if the number is greater than what the module can handle, else true
-  void SetAddressing(boolean addressing[]); //Sets up the addressing lines
-  byte SeparateCommandBySpace(); //Separates the _command string into two strings, the first is the first word before the space, the second is the original string with the first word deleted, returns the number of char written in _subCommand
-  byte CompareSubCommand(); //Compares a command with the commands' dictionary
-  boolean FetchCommand(); //Fetches a command from the serial port
+  void SetAddressing(byte address); //Sets up the addressing lines to the bits of address
+  void BuildAddressPorts(); //Finds the port registers and the masks of the addressing pins
+  void SplitCommand(); //Splits once the _command string into its words, terminating every word in place
+  byte NextToken(char* & token); //Points token to the next word of _command, returns its length or 0 if the words are finished
+  boolean FetchCommand(); //Fetches the available characters from the serial port, returns true when a whole command line or frame was read
   void DoCommand(byte numCommand); //Executes a command
-  byte GetCommand(char* command); //Gets the number of a command
+  byte DoFrame(); //Executes the binary frame in _command and sends the answer, returns the command executed
+  void SendFrame(byte id, byte status, const byte payload[], byte length); //Sends the answer to a binary frame
+  void SendReply(byte reply, byte id, byte status); //Sends the answer to a command whit an id
+  byte GetCommand(char* command, byte length); //Gets the number of a command, NCOMMAND if not found
+  byte GetSubCommand(char* command, byte length); //Gets the number of a sub command, NSUBCOMMAND if not found
+  boolean CompareKeyword(char* command, byte length, const DomoSKeyword* keyword); //Tells if a word is the keyword stored in the flash memory
   void CommandToLowerCase(); //Converts the _command string to lower case
-  void SubCommandShiftLeft(); //Shifts left of one position all the character in the _subCommand string
   byte SearchPeripheralByName(char peripheral[]); //Searches the peripheral by name
+  unsigned int HashName(const char name[]); //Computes the fingerprint of a peripheral name
+  void BuildIndex(); //Counts the stored peripherals and fills the name index and the number bitmap
+  boolean IsNumberUsed(byte number); //Tells if a peripheral with this number already exists
+  void MarkNumber(byte number, boolean used); //Sets or clears the bit of number in the number bitmap
+  byte SearchFreeNumber(byte number); //Searches the first free number starting from number, returns 0 if there isn't
   void GetPeripheralName(byte numPeripheral, char name[]); //Writes in char name[] the name of numPeripheral-th peripheral
+  void GetRecordName(const DomoSFileRecord & record, char name[]); //Writes in char name[] the name of a record already in memory
+  boolean PackName(const char name[], byte packed[]); //Packs a name for storing it, returns false if a character isn't allowed
+  void UnpackName(const byte packed[], char name[]); //Unpacks a stored name
+  byte CharToCode(char c); //Gets the code of a character in a packed name, 0 if not allowed
   boolean SearchDuplicatedPeripheral(DomoSFileBody & peripheral, boolean nameCustom, boolean numberCustom); //Checks if the peripheral is unique else tries to make it unique
   void GetPeripheralNumber(byte numPeripheral, byte & number); //Writes in "number" the number of numPeripheral-th peripheral
-  byte ConvertBinaryStringToDecimal();
+  void GetPeripheralChannel(byte numPeripheral, byte & channel); //Writes in "channel" the output channel of numPeripheral-th peripheral
+  byte ConvertBinaryStringToDecimal(char binary[]);
   void BlankNewPeripheral(DomoSFileBody & peripheral);
   boolean CreateParameterCheck(DomoSFileBody & peripheral);
-  boolean WritePeripheral(DomoSFileBody peripheral, byte position);
+  boolean WritePeripheral(DomoSFileBody peripheral, byte position); //Writes a peripheral into a slot of the storage
   byte SearchPeripheralByNumber(byte number);
   void ComposeStringPeripheral(DomoSFileBody peripheral, byte phrase);
   
   byte GetError();
 
-  boolean WritePeripheralToEeprom(DomoSFileBody peripheral, byte position); //Writes the peripheral to the EEPROM
-  //boolean WritePeripheralToSd(DomoSFileBody peripheral, byte position); //Function not yet developed
+  void ErasePeripheral(byte position); //Marks the slot of a peripheral as free
+  byte SearchFreeSlot(byte number); //Searches the slot where to write a new peripheral with number, -1 if the table is full
+  void CompactTable(); //Moves all the peripherals at the start of the table, sorted by number
+  boolean CompactStep(); //Moves a single peripheral of the compaction, returns true when the table is compact
+  byte NumberRank(byte number); //Counts the used numbers smaller than number, the slot of its peripheral in the compact table
+  void MovePeripheral(byte from, byte to); //Moves a peripheral into a free slot
+  boolean KeepsOrder(byte position, byte number); //Tells if a peripheral with number in position is between a smaller and a bigger number
+  int PeripheralAddress(byte position); //Gets the address of the first cell of a slot
+  int NumberMapAddress(byte number); //Gets the address of the cell of the number map for number
   
   void Create(); //Create a peripheral
+  boolean CreatePeripheral(DomoSFileBody & peripheral); //Checks and writes a new peripheral, returns false if it can't be created
+  boolean CheckNewPeripheral(const DomoSFileBody & peripheral, boolean numberCustom, byte numAccepted); //Checks the values of a new peripheral, shared by create and import
   void Turn(); //Activate a peripheral
+  void TurnPeripherals(DomoSActuation & actuation); //Queues the actuation of the targets
+  boolean SearchTurnTargets(char list[], DomoSActuation & actuation); //Fills the targets of actuation with the peripherals listed in list
+  boolean AddTurnTarget(byte peripheral, DomoSActuation & actuation); //Adds the peripheral in a slot to the targets of actuation
+  void OrderTargets(DomoSActuation & actuation); //Orders the targets for changing as few addressing lines as possible
+  byte CountBits(byte value); //Counts the bits set in value
+  boolean QueueActuation(DomoSActuation & actuation); //Queues an actuation, returns false if the queue is full
+  void Actuate(); //Goes ahead with the actuation of the queued peripherals
+  void AddressTarget(); //Sets the addressing lines to the current target of the actuation in progress
+  boolean IsChannelReady(byte channel, byte value); //Tells if channel is charged at value
+  void ChargeChannels(); //Charges every channel at the value of its next target
   void Delete(); //Delete a peripheral, probably this wont be developed
+  void DeletePeripheral(byte position); //Deletes the peripheral in a slot
   void Exit(); //Turn off DomoS module
   void Reset(); //Resets the DomoS module
   void List(); //Give a list of all the installed peripheral
+  void Stats(); //Give the statistics of the previous command
+  void Commit(); //Write into the storage all the changes
+  void Compact(); //Sort and compact the peripherals table
+  void WipeStep(); //Clears the next cell of the wipe in progress
+  void Export(); //Print all the peripherals as import commands
+  void Import(); //Create the peripherals of a line printed by export
+  boolean CheckImport(DomoSFileRecord record[], byte numRecord); //Checks if the imported records can be added to the table
+  void PrintHex(const byte data[], byte length); //Prints a block of memory as hex digits
+  boolean HexToBytes(const char text[], byte data[], byte length); //Converts hex digits, returns false if a character isn't a digit
+
+  byte ReadStorage(int address); //Reads a cell of the storage
+  void ReadStorage(int address, byte data[], byte length); //Reads a block of cells of the storage
+  void WriteStorage(int address, byte value); //Writes a cell of the storage, the writing can be delayed
+  void WriteStorage(int address, const byte data[], byte length); //Writes a block of cells of the storage, the writing can be delayed
+  void FlushStorage(); //Writes into the storage the oldest delayed cell
+  void CommitStorage(); //Writes into the storage all the delayed cells
 
   int parseInt();
 
   void ThrownError();
+  void PrintPhrase(byte phrase); //Prints a phrase stored in the flash memory
+  void PrintError(byte error); //Prints the description of an error stored in the flash memory
 
   //Declaration of configuration variables
   byte _numAddressPin; //Number of pins used for addressing peripherals
   byte _addressPin[MAXADDRESSPIN]; //Pins used for addressing
-  byte _outputPin; //The pin used for the output, pin 6 will automatically be selected
+  byte _numChannel; //Number of output channels, their pins are automatically selected
+  byte _channelPin[MAXCHANNEL]; //The output pin of each channel
+  boolean _shiftRegister; //True if the addressing lines are the outputs of 74HC595 shift registers, _addressPin[0] is their latch pin
+
+  /*
+   The addressing pins are written directly on the output registers of their ports, with a
+   single write for each port, so all the addressing lines of a port change at the same time
+   */
+  struct DomoSAddressPort
+  {
+    volatile byte* output; //The output register of the port
+    byte mask; //The bits of the port used by the addressing pins
+  };
+
+  DomoSAddressPort _addressPort[MAXADDRESSPIN]; //The ports of the addressing pins
+  byte _numAddressPort; //Number of ports used by the addressing pins
+  byte _addressPinPort[MAXADDRESSPIN]; //The i-th addressing pin is in the _addressPinPort[i]-th port
+  byte _addressPinMask[MAXADDRESSPIN]; //The bit of the i-th addressing pin in its port
   byte _writeToEeprom; //-1 if DomoS must store the peripheral settings in the EEPROM, else the CSPin where the SD card is connected for storing the settings in DomoS.dat file
   byte _numPeripheral; //Number of peripheral created by user
+  byte _numSlot; //Number of slots of the table in use, the deleted peripherals included
+  byte _numSorted; //Number of slots at the start of the table sorted by number, the free ones included
   byte _fileVer; //The version of the file type
 
+  /*
+   The header is always stored in the EEPROM, the slots of the peripherals in _storage: the
+   EEPROM itself or the DomoS.dat file if a CS pin was set
+   Both use the same addresses, so a slot is always at PeripheralAddress
+   */
+  DomoSEepromStorage _eeprom;
+#if defined(DOMOS_USE_FILE)
+  DomoSFileStorage _file;
+#endif
+  DomoSStorage* _storage; //Where the slots are stored
+  boolean _storageOpen; //True when _storage was chosen
+  byte _maxSlot; //Number of slots the storage can contain
+  boolean _numberMap; //True if the storage contains the number map
+
+  static const int NUMBERMAPSIZE = 1 << MAXADDRESSPIN; //A cell for every number
+  static const byte NOSLOT = 255; //The value of the number map for the unused numbers
+
   boolean _on; //Tell if DOMOS system is on
+
+  //Statistics for measuring the performance
+  unsigned long _storageReads; //Number of storage cells read since the start
+  unsigned long _storageWrites; //Number of storage cells written since the start
+  unsigned long _queuedWrites; //Number of storage cells given to WriteStorage since the start, also the ones still dirty
+  byte _lastCommand; //The number of the previous command, NCOMMAND if it wasn't recognized
+  unsigned long _lastCommandTime; //Microseconds spent by the previous command
+  unsigned long _lastCommandReads; //Number of storage cells read by the previous command
+  unsigned long _lastCommandWrites; //Number of storage cells the previous command gave to WriteStorage, they're written when idle
+
+  /*
+   Writing an EEPROM cell takes 3.3ms, so the writings are delayed: WriteStorage only keeps the
+   cell in the dirty cells, then Work writes one of them each time it has nothing to do
+   ReadStorage reads the dirty cells before the storage, so the delay can't be seen
+   */
+  struct DomoSDirtyCell
+  {
+    int address; //The address of the cell
+    byte value; //The value waiting to be written
+  };
+
+  static const byte MAXDIRTY = 32; //Maximum number of cells waiting to be written
+  DomoSDirtyCell _dirty[MAXDIRTY]; //The cells waiting to be written, the oldest first
+  byte _numDirty; //Number of cells waiting to be written
   byte _lastError; //Tell the last error thrown by DomoS
 
   /*
    Declaration of strings constant
    Inizialization in DomoS.cpp
+   All the tables and their strings are stored in the flash memory (PROGMEM)
+   */
+  static const byte NCOMMAND = 12; //number of commands allowed
+  static const DomoSCommand COMMAND[NCOMMAND]; //Array of commands, for explanation go to inizialization
+
+  static const byte NSUBCOMMAND = 3; //number of sub commands of create
+  static const DomoSKeyword SUBCOMMAND[NSUBCOMMAND]; //Array of sub commands, for explanation go to inizialization
+  static const byte NAMESUBCOMMAND = 0; //Position of the sub commands into SUBCOMMAND
+  static const byte ASSUBCOMMAND = 1;
+  static const byte ONSUBCOMMAND = 2;
+
+  static const DomoSKeyword WIPEOPTION; //The option of reset for clearing all the storage
+
+  /*
+   Binary frames, for the programs driving DomoS without the text commands
+   request: FRAMESYNC, length, opcode, id, fields, CRC
+   answer: FRAMESYNC, length, id, status (the error, OK if it went right), payload, CRC
+   length counts the bytes from the opcode (or the id) to the last field, the CRC is Crc8 of
+   the length and of all the bytes after it
+   FRAMESYNC is never in a text line, so a frame can be sent after any whole line
+   The answer of turn is sent when all the peripherals are actuated, so more frames can be in
+   flight and their answers can arrive in a different order
    */
-  static const byte NCOMMAND = 8; //number of commands allowed
-  static const char* COMMAND[NCOMMAND]; //Array of commands, for explanation go to inizialization
+  static const byte FRAMESYNC = 0xA5;
+  static const byte FRAMEMAXLEN = 16; //Maximum length of a frame, it's read into _command
+  static const unsigned long FRAMETIMEOUT = 100; //Milliseconds after that a frame not finished is ignored
 
-  static const int NPHRASE = 12; //Number of phrases, for eventually translation
-  static const char* PHRASE[NPHRASE];
+  //The opcodes are the position of the same command into COMMAND, so stats shows them
+  static const byte FRAMECREATE = 0; //fields: number (0 for the first free), channel, name (none for the standard name); payload: number
+  static const byte FRAMETURN = 1; //fields: value, the numbers of the peripherals (up to MAXTARGET)
+  static const byte FRAMEDELETE = 2; //fields: number
 
-  static const int NERROR = 24;
-  static const char* ERROR[NERROR];
+  /*
+   A text command can start whit #id (0-255), then when it's complete DomoS answers "#id status",
+   status is the error (OK if it went right), and the error isn't printed
+   Like the frames, a turn is answered when its peripherals are actuated and at most MAXACTUATION
+   turns can be in flight, while the other commands are answered immediately
+   */
+  static const byte NOREPLY = 0; //The command hasn't an id, nothing is answered
+  static const byte TEXTREPLY = 1; //The answer is the text "#id status"
+  static const byte FRAMEREPLY = 2; //The answer is a frame
+  byte _commandReply; //The answer of the command being executed
+  byte _commandId; //The id of the command being executed
+  boolean _replyDeferred; //True if the command being executed will be answered by Actuate
+
+  //Peripherals in a line of export, a line with its CRC must fit in STRINGMAXLEN
+  static const byte IMPORTCHUNK = 3;
+
+  static const int NPHRASE = 19; //Number of phrases, for eventually translation
+  static const char* const PHRASE[NPHRASE];
+
+  static const int NERROR = 33;
+  static const char* const ERROR[NERROR];
 
   static const int START = 2;
   static const byte SETUP[START]; //These two values are stored in the first two cell of EEPROM, if already present the system have been already setup, if not launch the first start procedure
   
   static const int RCLOAD = 300; //Number of millisecond necessary for charging of RC circuit
+  static const int SETTLE = 1000; //Number of millisecond necessary for the spread of signals
+
+  /*
+   The actuation of a peripheral is done in background by Actuate, called by Work
+   Turn only puts the peripherals in the actuation queue, then:
+   - every channel is charged at the value of its next queued target, or discharged if there isn't
+   - when the channel of the next target is at its value since RCLOAD ms, the addressing lines
+     are set to the target, then after SETTLE ms Actuate goes to the next target
+   - if the channel of the next target isn't ready the addressing lines are cleared, and
+     the channel of the addressed peripheral is never changed
+   The targets are addressed one at a time, but while a target is settling the other channels are
+   already charging, so the turns on different channels don't wait each other's charge
+   */
+  static const byte NOCHANNEL = 255; //_addressedChannel when the addressing lines are cleared
+
+  static const byte MAXACTUATION = 4; //Maximum number of queued actuation
+  DomoSActuation _actuation[MAXACTUATION]; //Circular queue of the actuation to be done
+  byte _firstActuation; //Position of the actuation in progress
+  byte _numActuation; //Number of queued actuation, the one in progress included
+  byte _currentTarget; //The next target of the actuation in progress to be addressed, or the one addressed
+  boolean _settling; //True while waiting SETTLE ms for the addressed target
+  byte _addressedChannel; //The channel of the peripheral on the addressing lines, NOCHANNEL if there isn't
+  unsigned long _actuationTime; //The millis() value when the addressed target was set
+  byte _channelValue[MAXCHANNEL]; //The value written on the output pin of each channel
+  unsigned long _channelTime[MAXCHANNEL]; //The millis() value when each channel was set
+
+  static const int HEADERCRC = -1; //The address of the CRC of the header, it's stored in the last EEPROM cell (E2END)
+
+  //Maximum number of peripheral the EEPROM can contain, the address space can't handle more than 255
+  //The DomoS.dat file can always contain 255 peripherals
+  static const int EEPROMPERIPHERAL = (E2END - START - sizeof(DomoSFileHeader)) / sizeof(DomoSFileRecord);
+#if defined(DOMOS_USE_FILE)
+  static const byte MAXPERIPHERAL = 255;
+#else
+  static const byte MAXPERIPHERAL = (EEPROMPERIPHERAL < 255) ? EEPROMPERIPHERAL : 255;
+#endif
+
+  //The same for the version 0 and 1 files, used only by MigrateFile and IsOldHeader
+  static const byte OLDRECORDSIZE = MAXNAMELEN + 1;
+  static const int OLDEEPROMPERIPHERAL = (E2END + 1 - START - sizeof(DomoSFileHeader)) / OLDRECORDSIZE;
+  static const byte OLDMAXPERIPHERAL = (OLDEEPROMPERIPHERAL < 255) ? OLDEEPROMPERIPHERAL : 255;
+
+  static const byte MAXHOLES = 8; //Free slots reused by Create when the end of the table is reached, whit more the table is compacted
+  boolean _compacting; //True if a compaction is in progress
+  int _compactNumber; //The next number to be moved by the compaction in progress
+  byte _compactPosition; //The slot where the next peripheral is moved by the compaction in progress
+
+  /*
+   reset wipe clears every cell of the EEPROM and of the file, a cell at a time when Work is idle,
+   so the controller doesn't stop for the seconds needed by the whole EEPROM
+   The cells are numbered from the EEPROM ones to the file ones after the header
+   */
+  static const byte WIPESTEP = 10; //The progress is printed every WIPESTEP percent
+  boolean _wiping; //True if a wipe is in progress
+  int _wipePosition; //The next cell to be cleared
+  byte _wipeProgress; //The last percentage printed
+
+  /*
+   The configuration and the indexes built at startup are kept in a RAM region not cleared by a
+   reset (.noinit), so after a watchdog or soft reset they're used without reading the storage
+   The snapshot is saved by Work when idle and nothing is waiting to be written, every change
+   of the storage or of the indexes makes it not valid until the next saving
+   */
+  struct DomoSSnapshot
+  {
+    unsigned long check; //SNAPSHOTCHECK if the snapshot was saved
+    byte crc; //The CRC of all the fields after it
+    DomoSFileHeader header; //The configuration, as in the EEPROM
+    byte numPeripheral; //The counters of the table
+    byte numSlot;
+    byte numSorted;
+
+    //Fingerprints of the peripheral names, the i-th element is the fingerprint of the i-th slot
+    //Used for finding a peripheral without reading all the names from the storage, 0 for the free slots
+    unsigned int nameIndex[MAXPERIPHERAL];
+
+    //One bit for every possible peripheral number, set if the number is already used
+    //The n-th number is the (n % 8)-th bit of the (n / 8)-th byte
+    byte usedNumber[(1 << MAXADDRESSPIN) / 8];
+  };
+
+  static const unsigned long SNAPSHOTCHECK = 0xD0305EEDUL; //Tells the snapshot was saved, the RAM can have any value at power on
+  static DomoSSnapshot _snapshot; //There's only a DomoS module, so the snapshot is shared
+
+  //Time and storage readings from the start to the welcome message
+  unsigned long _bootTime; //Microseconds spent
+  unsigned long _bootReads; //Number of cells read
+  boolean _warmBoot; //True if the snapshot was used
 
   //String for fetching and checking commands
   char _command[STRINGMAXLEN];
-  char _subCommand[SUBSTRINGMAXLEN];
+  byte _commandLen; //Number of character of the command line already read
+  boolean _discardLine; //True if the command line was too long and must be ignored until its end
+  boolean _inFrame; //True if a binary frame is being read, _command contains its bytes
+  unsigned long _frameTime; //Value of millis() when the frame started
+
+  //The words of _command, the i-th word start at _command[_tokenStart[i]] and is _tokenLen[i] character long
+  //After the last word there's always an empty word pointing to the string terminator
+  byte _tokenStart[MAXTOKEN + 1];
+  byte _tokenLen[MAXTOKEN + 1];
+  byte _numToken; //Number of words in _command
+  byte _nextToken; //The next word returned by NextToken
 
 public:
   //Constructor
@@ -160,6 +500,15 @@ public:
   static const byte VOLTAGETOOHIGH = 21;
   static const byte DECIMALNUMBERTOOBIG = 22;
   static const byte THEREAREZEROPERIPHERAL = 23;
+  static const byte ACTUATIONQUEUEFULL = 24;
+  static const byte TOOMANYTARGETS = 25;
+  static const byte NAMEINVALIDCHARACTER = 26;
+  static const byte STORAGENOTAVAILABLE = 27;
+  static const byte CHANNELNOTVALID = 28;
+  static const byte WIPEINPROGRESS = 29;
+  static const byte IMPORTNOTVALID = 30;
+  static const byte FRAMENOTVALID = 31;
+  static const byte ADDRESSPINNOTVALID = 32;
 };
 #endif
 
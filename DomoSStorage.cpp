@@ -0,0 +1,207 @@
+#include "DomoSStorage.h"
+#include <Arduino.h>
+#include <EEPROM.h>
+
+#if defined(DOMOS_USE_FILE) && !defined(DOMOS_USE_SD)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+static const char FILENAME[] = "DomoS.dat"; //The file used by DomoSFileStorage
+
+int DomoSEepromStorage::Size()
+/*	E2END constant contain the number of the last EEPROM cell
+ */
+{
+  return E2END + 1;
+}
+
+void DomoSEepromStorage::Read(int address, byte data[], int length)
+/*	Read the cells one by one, the EEPROM hasn't a faster way
+ */
+{
+  int i;
+
+  for (i = 0; i < length; i++)
+    data[i] = EEPROM.read(address + i);
+
+  return;
+}
+
+void DomoSEepromStorage::Write(int address, const byte data[], int length)
+/*	Write the cells one by one
+ 	The callers already skip the cells that doesn't change
+ */
+{
+  int i;
+
+  for (i = 0; i < length; i++)
+    EEPROM.write(address + i, data[i]);
+
+  return;
+}
+
+void DomoSEepromStorage::Sync()
+/*	Nothing to do, every cell is written immediately
+ */
+{
+  return;
+}
+
+#if defined(DOMOS_USE_FILE)
+
+int DomoSFileStorage::Size()
+{
+  return FILESIZE;
+}
+
+#if defined(DOMOS_USE_SD)
+
+boolean DomoSFileStorage::Begin(byte csPin)
+/*	Start the SD card and open DomoS.dat
+ 	If the file is shorter than FILESIZE fill it with 0, so the new slots are free
+ */
+{
+  boolean ok;
+  long size;
+
+  _numSector = -1; //No sector in memory
+  _sectorDirty = false;
+
+  pinMode(csPin, OUTPUT);
+  ok = SD.begin(csPin);
+  if (ok)
+  {
+    //FILE_WRITE would append every writing at the end of the file
+    _file = SD.open(FILENAME, O_READ | O_WRITE | O_CREAT);
+    ok = _file;
+  }
+
+  if (ok)
+  {
+    size = _file.size();
+    if (size < FILESIZE)
+    {
+      _file.seek(size);
+      for (; size < FILESIZE; size++)
+        _file.write((byte)0);
+      _file.flush();
+    }
+  }
+
+  return ok;
+}
+
+void DomoSFileStorage::Read(int address, byte data[], int length)
+/*	Copy the cells from the sectors in memory, loading them when needed
+ */
+{
+  int i;
+
+  for (i = 0; i < length; i++, address++)
+  {
+    LoadSector(address / SECTORSIZE);
+    data[i] = _sector[address % SECTORSIZE];
+  }
+
+  return;
+}
+
+void DomoSFileStorage::Write(int address, const byte data[], int length)
+/*	Change the cells in the sector in memory, the card is written by Sync or when
+ 	another sector is needed
+ */
+{
+  int i;
+
+  for (i = 0; i < length; i++, address++)
+  {
+    LoadSector(address / SECTORSIZE);
+    _sector[address % SECTORSIZE] = data[i];
+    _sectorDirty = true;
+  }
+
+  return;
+}
+
+void DomoSFileStorage::Sync()
+/*	Write the sector in memory on the card if it was changed
+ */
+{
+  if (_sectorDirty)
+  {
+    _file.seek((long)_numSector * SECTORSIZE);
+    _file.write(_sector, SECTORSIZE);
+    _file.flush();
+    _sectorDirty = false;
+  }
+
+  return;
+}
+
+void DomoSFileStorage::LoadSector(int sector)
+/*	Bring a sector in memory, if it isn't already there
+ */
+{
+  if (sector != _numSector)
+  {
+    Sync(); //Don't lose the changes of the previous sector
+
+    _file.seek((long)sector * SECTORSIZE);
+    _file.read(_sector, SECTORSIZE);
+    _numSector = sector;
+  }
+
+  return;
+}
+
+#else
+
+boolean DomoSFileStorage::Begin(byte csPin)
+/*	Map DomoS.dat in memory, the CS pin isn't used on a computer
+ 	If the file is shorter than FILESIZE it's filled with 0, so the new slots are free
+ */
+{
+  int file;
+
+  (void)csPin;
+  _data = (byte*)MAP_FAILED;
+
+  file = open(FILENAME, O_RDWR | O_CREAT, 0644);
+  if (file >= 0)
+  {
+    if (ftruncate(file, FILESIZE) == 0)
+      _data = (byte*)mmap(NULL, FILESIZE, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+    close(file); //The mapping stays valid
+  }
+
+  return (_data != (byte*)MAP_FAILED);
+}
+
+void DomoSFileStorage::Read(int address, byte data[], int length)
+{
+  memcpy(data, _data + address, length);
+
+  return;
+}
+
+void DomoSFileStorage::Write(int address, const byte data[], int length)
+{
+  memcpy(_data + address, data, length);
+
+  return;
+}
+
+void DomoSFileStorage::Sync()
+/*	Ask the system to write the changed pages on the disk
+ */
+{
+  msync(_data, FILESIZE, MS_ASYNC);
+
+  return;
+}
+
+#endif
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef DomoSStorage_H
+
+#define DomoSStorage_H
+#include <Arduino.h>
+
+//#define DOMOS_USE_SD //Uncomment for storing the peripherals on the SD card when a CS pin was set
+
+#if defined(DOMOS_USE_SD)
+#include <SD.h>
+#endif
+
+/*
+ Where DomoS keeps its data, seen as an array of cells from 0 to Size() - 1
+ The cells are read and written in blocks, so every backend can move them in the cheapest way
+ DomoS calls the backends only through ReadStorage, FlushStorage and CommitStorage
+ */
+class DomoSStorage
+{
+public:
+  virtual int Size() = 0; //Number of cells of the storage
+  virtual void Read(int address, byte data[], int length) = 0; //Reads length cells starting from address
+  virtual void Write(int address, const byte data[], int length) = 0; //Writes length cells starting from address
+  virtual void Sync() = 0; //Writes on the device the cells still kept in memory
+};
+
+/*
+ The internal arduino EEPROM, every cell is read and written directly
+ */
+class DomoSEepromStorage : public DomoSStorage
+{
+public:
+  int Size();
+  void Read(int address, byte data[], int length);
+  void Write(int address, const byte data[], int length);
+  void Sync();
+};
+
+#if defined(DOMOS_USE_SD) || !defined(ARDUINO)
+#define DOMOS_USE_FILE
+
+/*
+ The DomoS.dat file, the cells are the bytes of the file
+ On arduino the file is on an SD card, on a computer it's mapped in memory
+ The file has always FILESIZE cells, enough for 255 peripherals
+ */
+class DomoSFileStorage : public DomoSStorage
+{
+public:
+  boolean Begin(byte csPin); //Opens the file, creating it if needed, returns false if it can't be used
+  int Size();
+  void Read(int address, byte data[], int length);
+  void Write(int address, const byte data[], int length);
+  void Sync();
+
+  static const int FILESIZE = 4096;
+
+private:
+#if defined(DOMOS_USE_SD)
+  /*
+   The SD card is written by sectors of 512 byte, so the sector last used is kept in memory
+   and written only when another sector is needed or on Sync
+   */
+  static const int SECTORSIZE = 512;
+
+  void LoadSector(int sector); //Brings a sector in memory, writing the previous one if changed
+
+  File _file;
+  byte _sector[SECTORSIZE]; //The cells of the sector in memory
+  int _numSector; //The number of the sector in memory, -1 if there isn't
+  boolean _sectorDirty; //True if the sector in memory was changed
+#else
+  byte* _data; //The file mapped in memory
+#endif
+};
+
+#endif
+
+#endif
@@ -1,5 +1,4 @@
 #include "DomoS.h"
-#include <Serial.h>
 #include <EEPROM.h>
 
 void setup()
@@ -0,0 +1,187 @@
+#include "DomoS.h"
+#include "Shim.h"
+#include <stdio.h>
+#include <chrono>
+
+/*
+ Benchmark of DomoS on the simulated board of test/shim, built once for every EEPROM size
+ The table is filled up to its capacity, then every operation is run many times and measured:
+ - wall time of the Work call that parses and executes the command
+ - EEPROM reads of that call
+ - EEPROM writes, also the ones done later when idle, until the next command
+ - virtual time spent in delay
+ Every operation prints a line of key=value pairs, easy to be compared between versions:
+ bench e2end=1023 capacity=126 peripherals=126 op=turnname runs=50 ns=1520 reads=9 writes=0 delayms=0
+ ns, reads, writes and delayms are the averages of a run
+
+ Usage: DomoSBenchmark [runs]
+ */
+
+static const unsigned long IDLE = 2000; //Virtual milliseconds of Work after a command, the actuation and the writings end
+
+//1 channel, direct addressing whit 8 address pins, peripherals into the EEPROM
+static const char SETUP[] = "1\n0\n8\n2\n4\n7\n8\n10\n11\n12\n13\n-1\n";
+
+struct Measure
+{
+  unsigned long runs;
+  double ns; //Wall time
+  unsigned long reads;
+  unsigned long writes;
+  unsigned long delayMs;
+};
+
+static DomoS* domoS;
+static long capacity; //The number of peripherals the table can contain
+static long peripherals; //The number of peripherals in the table
+static long number[256]; //The number of every peripheral, pN is the N-th
+
+static std::string Idle(unsigned long ms)
+/*	Let DomoS work for ms virtual milliseconds, return what was printed
+ */
+{
+  unsigned long i;
+
+  for (i = 0; i < ms; i++)
+  {
+    domoS->Work();
+    ShimAdvance(1);
+  }
+
+  return ShimTakeOutput();
+}
+
+static std::string Execute(const char command[], Measure & measure)
+/*	Send a command and add what it costed to measure, return what was printed
+ 	The command is read and executed by a single Work call, that is the one timed
+ */
+{
+  std::chrono::steady_clock::time_point start;
+  unsigned long reads, writes, delayMs;
+  std::string output;
+
+  ShimInput(command);
+  ShimInput("\n");
+  reads = EEPROM.reads;
+  writes = EEPROM.writes;
+  delayMs = ShimDelayTime;
+
+  start = std::chrono::steady_clock::now();
+  domoS->Work();
+  measure.ns += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+  measure.reads += EEPROM.reads - reads;
+
+  ShimAdvance(1);
+  output = Idle(IDLE);
+  measure.writes += EEPROM.writes - writes;
+  measure.delayMs += ShimDelayTime - delayMs;
+  measure.runs++;
+
+  return output;
+}
+
+static long Created(const std::string & output)
+/*	Return the number given to a new peripheral, read from the answer of create, -1 if it failed
+ */
+{
+  size_t position;
+
+  position = output.find(" whit number ");
+
+  return (position != std::string::npos) ? atol(output.c_str() + position + 13) : -1;
+}
+
+static long Stat(const char field[])
+/*	Return a field of the stats command, -1 if it's not printed
+ */
+{
+  std::string output;
+  size_t position;
+
+  ShimInput("stats\n");
+  output = Idle(1);
+  position = output.find(std::string(" ") + field + "=");
+
+  return (position != std::string::npos) ? atol(output.c_str() + position + strlen(field) + 2) : -1;
+}
+
+static void Print(const char op[], const Measure & measure)
+{
+  printf("bench e2end=%d capacity=%ld peripherals=%ld op=%s runs=%lu ns=%.0f reads=%.1f writes=%.1f delayms=%.1f\n",
+         E2END, capacity, peripherals, op, measure.runs, measure.ns / measure.runs,
+         (double)measure.reads / measure.runs, (double)measure.writes / measure.runs,
+         (double)measure.delayMs / measure.runs);
+
+  return;
+}
+
+int main(int argc, char* argv[])
+{
+  Measure fill = {}, turnName = {}, turnNumber = {}, create = {}, remove = {}, list = {}, parse = {};
+  char command[64];
+  long runs;
+  long i, n;
+
+  runs = (argc > 1) ? atol(argv[1]) : 50;
+
+  ShimClearEeprom(0xFF);
+  ShimPowerOn();
+  ShimInput(SETUP);
+  domoS = new DomoS();
+  ShimTakeOutput();
+
+  //The address pins can't handle more than 255 peripherals
+  capacity = Stat("capacity");
+  if (capacity > 255)
+    capacity = 255;
+
+  //Fill the table whit the peripherals p0, p1, ...
+  for (peripherals = 0; peripherals < capacity; peripherals++)
+  {
+    snprintf(command, sizeof(command), "create name p%ld", peripherals);
+    number[peripherals] = Created(Execute(command, fill));
+  }
+  if (Stat("peripherals") != capacity)
+  {
+    printf("bench e2end=%d error=fill peripherals=%ld capacity=%ld\n", E2END, Stat("peripherals"), capacity);
+    return 1;
+  }
+  fill.runs = 1; //The totals of the whole fill
+  Print("fill", fill);
+
+  for (i = 0; i < runs; i++)
+  {
+    n = (i * 37) % capacity; //Spread the peripherals over the table
+
+    snprintf(command, sizeof(command), "turn p%ld high", n);
+    Execute(command, turnName); //SearchPeripheralByName
+    snprintf(command, sizeof(command), "turn #%ld low", number[n]);
+    Execute(command, turnNumber); //SearchPeripheralByNumber
+
+    //The table stays full
+    snprintf(command, sizeof(command), "delete p%ld", n);
+    Execute(command, remove);
+    snprintf(command, sizeof(command), "create name p%ld", n);
+    number[n] = Created(Execute(command, create)); //Automatic number
+    if (number[n] < 0)
+    {
+      printf("bench e2end=%d error=create peripherals=%ld capacity=%ld\n", E2END, Stat("peripherals"), capacity);
+      return 1;
+    }
+
+    Execute("list", list);
+    Execute("create name parse as b101 on 7", parse); //Every word is parsed, then the channel is refused
+  }
+  ShimTakeOutput();
+
+  Print("turnname", turnName);
+  Print("turnnumber", turnNumber);
+  Print("create", create);
+  Print("delete", remove);
+  Print("list", list);
+  Print("parse", parse);
+
+  delete domoS;
+
+  return 0;
+}
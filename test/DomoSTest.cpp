@@ -0,0 +1,1151 @@
+#include "DomoS.h"
+#include "Shim.h"
+#include <stdio.h>
+#include <chrono>
+#include <set>
+
+/*
+ Behavioural tests of DomoS on the simulated board of test/shim
+ Every test drives DomoS only by the serial port, as a user would do, and checks what it
+ printed, the pins it wrote and the accesses to the EEPROM
+ */
+
+static int failures; //Number of checks failed
+
+#define CHECK(condition) Check((condition), #condition, __FILE__, __LINE__)
+
+static void Check(bool ok, const char condition[], const char file[], int line)
+{
+  if (!ok)
+  {
+    printf("%s:%d: CHECK(%s) failed\n", file, line, condition);
+    failures++;
+  }
+}
+
+static const int STRINGLEN = 64; //Maximum length of a command
+
+//1 channel, direct addressing whit 3 address pins (2, 3, 4), peripherals into the EEPROM
+static const char SETUP[] = "1\n0\n3\n2\n3\n4\n-1\n";
+
+//The table starts after the setup cells and the header, a slot is 7 cells of name and the number
+static const int FIRSTSLOT = 15;
+static const int SLOTSIZE = 8;
+
+//The number map is after the biggest table of 255 slots, only if the EEPROM has room for it (4 KB)
+static const int NUMBERMAP = FIRSTSLOT + 255 * SLOTSIZE;
+static const bool HASNUMBERMAP = (E2END >= NUMBERMAP + 256);
+static const unsigned long MAPWRITES = HASNUMBERMAP ? 1 : 0; //Writes of the number map for a create or a delete
+
+static DomoS* Boot(const char setup[])
+/*	Power on the board and start DomoS, answering to the first start questions whit setup
+ */
+{
+  DomoS* domoS;
+
+  ShimPowerOn();
+  ShimInput(setup);
+  domoS = new DomoS();
+  ShimTakeOutput();
+
+  return domoS;
+}
+
+static DomoS* FirstStart(const char setup[])
+/*	Start DomoS on a new board, whit an empty EEPROM
+ */
+{
+  ShimClearEeprom(0xFF);
+
+  return Boot(setup);
+}
+
+static std::string Run(DomoS* domoS, const char command[], unsigned long ms)
+/*	Send a command and let DomoS work for ms virtual milliseconds, enough for it to answer and
+ 	to write into the EEPROM when idle, return what was printed
+ */
+{
+  unsigned long i;
+
+  ShimInput(command);
+  ShimInput("\n");
+  for (i = 0; i < ms; i++)
+  {
+    domoS->Work();
+    ShimAdvance(1);
+  }
+
+  return ShimTakeOutput();
+}
+
+static int Status(DomoS* domoS, const char command[])
+/*	Send a command whit an id and return the error code of its answer, -1 if it didn't answer
+ 	A turn is answered only after the actuation, so DomoS works for 5 virtual seconds
+ */
+{
+  std::string text, output;
+  size_t reply;
+
+  text = std::string("#1 ") + command;
+  output = Run(domoS, text.c_str(), 5000);
+  reply = output.find("#1 ");
+
+  return (reply != std::string::npos) ? atoi(output.c_str() + reply + 3) : -1;
+}
+
+static long Stat(DomoS* domoS, const char field[])
+/*	Return a field of the stats command, -1 if it's not printed
+ */
+{
+  std::string output;
+  size_t position;
+
+  output = Run(domoS, "stats", 1);
+  position = output.find(std::string(" ") + field + "=");
+
+  return (position != std::string::npos) ? atol(output.c_str() + position + strlen(field) + 2) : -1;
+}
+
+static void TestCreateTurnDelete()
+/*	A peripheral is created, turned on and deleted; the turn only reads the EEPROM and the
+ 	create and the delete write only the cells of the slot
+ */
+{
+  DomoS* domoS;
+  unsigned long reads, writes;
+  size_t i, high, address;
+
+  domoS = FirstStart(SETUP);
+  CHECK(domoS->IsOn());
+
+  writes = EEPROM.writes;
+  CHECK(Status(domoS, "create name lamp as 5") == DomoS::OK);
+  CHECK(EEPROM.writes - writes > 0);
+  CHECK(EEPROM.writes - writes <= 8 + MAPWRITES); //One slot, the snapshot is in RAM
+  CHECK(Stat(domoS, "writes") == (long)(EEPROM.writes - writes)); //Charged to create even if written when idle
+
+  reads = EEPROM.reads;
+  writes = EEPROM.writes;
+  ShimPinLog.clear();
+  CHECK(Status(domoS, "turn lamp high") == DomoS::OK);
+  CHECK(EEPROM.writes == writes);
+  CHECK(EEPROM.reads - reads < 16); //Only the slot found by the index
+
+  //The channel 0 (pin 6) at full power, then the address 5 (101) on the pins 2, 3, 4
+  high = ShimPinLog.size();
+  address = ShimPinLog.size();
+  for (i = 0; i < ShimPinLog.size(); i++)
+    if ((ShimPinLog[i].pin == 6) && (ShimPinLog[i].analog) && (ShimPinLog[i].value == 255))
+      high = i;
+    else if ((ShimPinLog[i].pin == ShimPortPin + PD) && (ShimPinLog[i].value == ((1 << 2) | (1 << 4))))
+      address = i;
+  CHECK(high < address);
+  CHECK(address < ShimPinLog.size());
+  CHECK(ShimDelayTime < 100); //The actuation doesn't block the serial port
+
+  writes = EEPROM.writes;
+  CHECK(Status(domoS, "delete lamp") == DomoS::OK);
+  CHECK(EEPROM.writes - writes == 1 + MAPWRITES); //Only the number is cleared
+  CHECK(Status(domoS, "turn lamp high") == DomoS::PERIPHERALNOTFOUND);
+
+  delete domoS;
+
+  return;
+}
+
+static void TestRestart()
+/*	The peripherals are still there after a power cut
+ */
+{
+  DomoS* domoS;
+
+  domoS = FirstStart(SETUP);
+  CHECK(Status(domoS, "create name lamp as 5") == DomoS::OK);
+  CHECK(Status(domoS, "create name fan on 0") == DomoS::OK);
+  delete domoS;
+
+  domoS = Boot("");
+  CHECK(Stat(domoS, "warmboot") == 0);
+  CHECK(Stat(domoS, "peripherals") == 2);
+  CHECK(Status(domoS, "turn lamp,fan low") == DomoS::OK);
+  delete domoS;
+
+  return;
+}
+
+static unsigned long TurnReads(DomoS* domoS, const char name[])
+/*	Return the EEPROM reads of turning a peripheral on by its name
+ */
+{
+  std::string command;
+  unsigned long reads;
+
+  command = std::string("turn ") + name + " high";
+  reads = EEPROM.reads;
+  CHECK(Status(domoS, command.c_str()) == DomoS::OK);
+
+  return EEPROM.reads - reads;
+}
+
+static void TestLookupReads()
+/*	Finding a peripheral by name reads only its slot, however many peripherals are stored:
+ 	the names are compared by their fingerprints in RAM
+ */
+{
+  DomoS* domoS;
+  unsigned long single, first, last;
+  char command[STRINGLEN];
+  int i;
+
+  //6 address pins, up to 63 peripherals
+  domoS = FirstStart("1\n0\n6\n2\n4\n7\n8\n10\n11\n-1\n");
+  CHECK(Status(domoS, "create name p0") == DomoS::OK);
+  single = TurnReads(domoS, "p0");
+
+  for (i = 1; i < 63; i++)
+  {
+    snprintf(command, sizeof(command), "create name p%d", i);
+    CHECK(Status(domoS, command) == DomoS::OK);
+  }
+  CHECK(Stat(domoS, "peripherals") == 63);
+
+  first = TurnReads(domoS, "p0");
+  last = TurnReads(domoS, "p62");
+  CHECK(first == single);
+  CHECK(last == single);
+  CHECK(single < 16); //A slot, the scan of the table would read 8 cells for every peripheral
+
+  delete domoS;
+
+  return;
+}
+
+static void TestAddressPorts()
+/*	The address pins are spread over the three ports of an Arduino Uno: every number must
+ 	set exactly its bits on every port, the first pin is the most significant bit, and the
+ 	other lines of the ports must not change
+ */
+{
+  //The pins 2 and 7 are on PD, 8 on PB, 14 and 15 on PC (Arduino Uno)
+  static const struct
+  {
+    byte port;
+    byte bit;
+  } PIN[] = { { PD, 2 }, { PB, 0 }, { PC, 0 }, { PC, 1 }, { PD, 7 } };
+  static const byte OTHERLINES = 1 << 5; //A line not used for the addressing, on every port
+
+  DomoS* domoS;
+  char command[STRINGLEN];
+  byte expected[PD + 1];
+  size_t i, event;
+  int number, pin;
+  byte port;
+
+  domoS = FirstStart("1\n0\n5\n2\n8\n14\n15\n7\n-1\n");
+
+  for (number = 1; number < 32; number++)
+  {
+    snprintf(command, sizeof(command), "create as %d", number);
+    CHECK(Status(domoS, command) == DomoS::OK);
+
+    memset(expected, OTHERLINES, sizeof(expected));
+    for (pin = 0; pin < 5; pin++)
+      if (number & (1 << (4 - pin)))
+        expected[PIN[pin].port] |= 1 << PIN[pin].bit;
+
+    for (port = PB; port <= PD; port++)
+      ShimPort[port] = OTHERLINES;
+    ShimPinLog.clear();
+    snprintf(command, sizeof(command), "turn #%d high", number);
+    CHECK(Status(domoS, command) == DomoS::OK);
+
+    //The first writing of the ports is the address
+    for (event = 0; (event < ShimPinLog.size()) && (ShimPinLog[event].pin != ShimPortPin + PB); event++);
+    CHECK(event + PD - PB < ShimPinLog.size());
+    for (i = event; (i < ShimPinLog.size()) && (i <= event + PD - PB); i++)
+      CHECK(ShimPinLog[i].value == expected[ShimPinLog[i].pin - ShimPortPin]);
+  }
+
+  delete domoS;
+
+  return;
+}
+
+static void TestShiftRegister()
+/*	With the shift registers every turn sends the number by SPI between the latch pin going
+ 	down and up again, so all the address lines change together
+ */
+{
+  static const byte LATCH = 10;
+
+  DomoS* domoS;
+  char command[STRINGLEN];
+  size_t event;
+  int number;
+
+  domoS = FirstStart("1\n10\n8\n-1\n");
+
+  //The latch is kept up, the outputs of the shift registers change only when it goes up
+  for (event = 0; (event < ShimPinLog.size()) && (ShimPinLog[event].pin != LATCH); event++);
+  CHECK((event < ShimPinLog.size()) && (ShimPinLog[event].value == HIGH));
+
+  for (number = 1; number < 256; number += 17)
+  {
+    snprintf(command, sizeof(command), "create as %d", number);
+    CHECK(Status(domoS, command) == DomoS::OK);
+
+    ShimPinLog.clear();
+    snprintf(command, sizeof(command), "turn #%d high", number);
+    CHECK(Status(domoS, command) == DomoS::OK);
+
+    //The first byte on the bus is the address, between the latch down and up
+    for (event = 0; (event < ShimPinLog.size()) && (ShimPinLog[event].pin != ShimSpiPin); event++);
+    CHECK((event > 0) && (event + 1 < ShimPinLog.size()));
+    if ((event > 0) && (event + 1 < ShimPinLog.size()))
+    {
+      CHECK(ShimPinLog[event].value == number);
+      CHECK((ShimPinLog[event - 1].pin == LATCH) && (ShimPinLog[event - 1].value == LOW));
+      CHECK((ShimPinLog[event + 1].pin == LATCH) && (ShimPinLog[event + 1].value == HIGH));
+    }
+  }
+
+  delete domoS;
+
+  return;
+}
+
+static DomoS* Reset(unsigned long & reads, double & us)
+/*	Press the reset button of the board and start DomoS again, measuring the EEPROM reads and
+ 	the wall time of the start
+ */
+{
+  DomoS* domoS;
+  std::chrono::steady_clock::time_point start;
+
+  ShimReset();
+  reads = EEPROM.reads;
+  start = std::chrono::steady_clock::now();
+  domoS = new DomoS();
+  us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+  reads = EEPROM.reads - reads;
+  ShimTakeOutput();
+
+  return domoS;
+}
+
+static void TestBootLatency()
+/*	After a reset DomoS starts from the snapshot in RAM whitout reading the table, but only if
+ 	the snapshot has all the changes; after a power cut it reads the whole table
+ */
+{
+  DomoS* domoS;
+  unsigned long coldReads, warmReads, reads;
+  double coldUs, warmUs, us;
+  char command[STRINGLEN];
+  int i;
+
+  domoS = FirstStart("1\n0\n6\n2\n4\n7\n8\n10\n11\n-1\n");
+  for (i = 0; i < 63; i++)
+  {
+    snprintf(command, sizeof(command), "create name p%d", i);
+    CHECK(Status(domoS, command) == DomoS::OK);
+  }
+  delete domoS;
+
+  //Power cut, the snapshot is lost
+  ShimPowerOn();
+  domoS = Reset(coldReads, coldUs);
+  CHECK(Stat(domoS, "warmboot") == 0);
+  CHECK(Stat(domoS, "bootreads") <= (long)coldReads); //Checking the first start isn't counted
+  CHECK(coldReads > 63 * 8); //Every slot
+  Run(domoS, "", 100); //Idle, the snapshot is saved
+  delete domoS;
+
+  domoS = Reset(warmReads, warmUs);
+  CHECK(Stat(domoS, "warmboot") == 1);
+  CHECK(Stat(domoS, "bootreads") <= (long)warmReads);
+  CHECK(warmReads < 32); //Only the header, checked against the snapshot
+
+  //A reset before a change is written, the snapshot isn't valid and the table is read again
+  ShimInput("delete p0\n");
+  domoS->Work();
+  delete domoS;
+  domoS = Reset(reads, us);
+  CHECK(Stat(domoS, "warmboot") == 0);
+  CHECK(Stat(domoS, "peripherals") == 63); //The delete was lost whit the dirty cells
+  delete domoS;
+
+  printf("boot cold us=%.0f reads=%lu warm us=%.0f reads=%lu\n", coldUs, coldReads, warmUs, warmReads);
+
+  return;
+}
+
+static unsigned long TurnTwo(DomoS* domoS, const char first[], const char second[])
+/*	Send two turns together and return the virtual milliseconds until both are answered
+ */
+{
+  std::string output;
+  unsigned long ms;
+
+  ShimInput("#1 ");
+  ShimInput(first);
+  ShimInput("\n#2 ");
+  ShimInput(second);
+  ShimInput("\n");
+  for (ms = 0; (ms < 10000) && ((output.find("#1 ") == std::string::npos) || (output.find("#2 ") == std::string::npos)); ms++)
+  {
+    domoS->Work();
+    ShimAdvance(1);
+    output += ShimTakeOutput();
+  }
+
+  return ms;
+}
+
+static bool ChargedAt(int pin, int value)
+/*	Tell if pin was charged at value since the log was cleared
+ */
+{
+  size_t event;
+
+  for (event = 0; (event < ShimPinLog.size()) && ((ShimPinLog[event].pin != pin)
+    || (!ShimPinLog[event].analog) || (ShimPinLog[event].value != value)); event++);
+
+  return (event < ShimPinLog.size());
+}
+
+static void TestChannelOverlap()
+/*	Two turns on different channels overlap: the second channel is charged while the first
+ 	target is settling, so they end before two turns on the same channel
+ 	The channel of a peripheral is kept after a reset and after a power cut
+ */
+{
+  //The pins of the channels 0 and 1 (Arduino Uno)
+  static const int PIN0 = 6;
+  static const int PIN1 = 5;
+
+  DomoS* domoS;
+  unsigned long overlapped, backToBack;
+  unsigned long reads;
+  double us;
+
+  domoS = FirstStart("2\n0\n3\n2\n3\n4\n-1\n");
+  CHECK(Status(domoS, "create name a on 0") == DomoS::OK);
+  CHECK(Status(domoS, "create name b on 1") == DomoS::OK);
+  CHECK(Status(domoS, "create name c on 0") == DomoS::OK);
+
+  backToBack = TurnTwo(domoS, "turn a %50", "turn c %80");
+  Run(domoS, "", 1000); //The channels are discharged
+  overlapped = TurnTwo(domoS, "turn a %50", "turn b %80");
+  CHECK(overlapped < backToBack);
+  CHECK(overlapped < 2400); //One charge and two settlings
+  printf("ChannelOverlap: two channels %lu ms, the same channel %lu ms\n", overlapped, backToBack);
+  Run(domoS, "", 1000);
+  delete domoS;
+
+  domoS = Reset(reads, us);
+  CHECK(Stat(domoS, "warmboot") == 1);
+  ShimPinLog.clear();
+  CHECK(Status(domoS, "turn b %80") == DomoS::OK);
+  CHECK(ChargedAt(PIN1, 204));
+  CHECK(!ChargedAt(PIN0, 204));
+  delete domoS;
+
+  ShimPowerOn();
+  domoS = Reset(reads, us);
+  CHECK(Stat(domoS, "warmboot") == 0);
+  ShimPinLog.clear();
+  CHECK(Status(domoS, "turn b %80") == DomoS::OK);
+  CHECK(ChargedAt(PIN1, 204));
+  CHECK(!ChargedAt(PIN0, 204));
+  delete domoS;
+
+  return;
+}
+
+static void TestTurnValues()
+/*	A percentage over 100 or a voltage over 5 is refused and nothing is charged, the other values
+ 	are converted to the 0-255 of the output pin
+ */
+{
+  DomoS* domoS;
+
+  domoS = FirstStart(SETUP);
+  CHECK(Status(domoS, "create name lamp") == DomoS::OK);
+
+  ShimPinLog.clear();
+  CHECK(Status(domoS, "turn lamp %150") == DomoS::STRANGETURNPARAMETER);
+  CHECK(Status(domoS, "turn lamp %-1") == DomoS::STRANGETURNPARAMETER);
+  CHECK(Status(domoS, "turn lamp v7") == DomoS::VOLTAGETOOHIGH);
+  CHECK(ShimPinLog.empty());
+
+  ShimPinLog.clear();
+  CHECK(Status(domoS, "turn lamp %100") == DomoS::OK);
+  CHECK(ChargedAt(6, 255));
+  ShimPinLog.clear();
+  CHECK(Status(domoS, "turn lamp %40") == DomoS::OK);
+  CHECK(ChargedAt(6, 102));
+  delete domoS;
+
+  return;
+}
+
+static void TestExitEndsTurns()
+/*	Exit ends the queued turns before going off, and the time goes ahead while it waits
+ */
+{
+  DomoS* domoS;
+  unsigned long start;
+
+  domoS = FirstStart(SETUP);
+  CHECK(Status(domoS, "create name lamp") == DomoS::OK);
+
+  ShimPinLog.clear();
+  start = millis();
+  ShimInput("turn lamp high\nexit\n");
+  domoS->Work(); //The turn is queued
+  domoS->Work(); //Exit waits for it
+  CHECK(!domoS->IsOn());
+  CHECK(ChargedAt(6, 255));
+  CHECK(millis() - start >= 1300); //The charge of the channel and the settling of the peripheral
+  CHECK(ShimTakeOutput().find("Buy buy") != std::string::npos);
+  delete domoS;
+
+  return;
+}
+
+static std::multiset<std::string> List(DomoS* domoS)
+/*	Return the lines printed by the list command
+ */
+{
+  std::multiset<std::string> peripheral;
+  std::string output;
+  size_t start, end;
+
+  output = Run(domoS, "list", 1);
+  for (start = 0; (end = output.find("\r\n", start)) != std::string::npos; start = end + 2)
+    peripheral.insert(output.substr(start, end - start));
+
+  return peripheral;
+}
+
+static void TestPowerCut()
+/*	A power cut while compact is writing the table, after any writing, must never lose or
+ 	duplicate a peripheral
+ */
+{
+  DomoS* domoS;
+  std::multiset<std::string> before;
+  byte image[E2END + 1];
+  char command[STRINGLEN];
+  long writes, cut;
+  int i, damaged;
+
+  //Peripherals whit mixed numbers and holes left by the deleted ones
+  domoS = FirstStart("1\n0\n6\n2\n4\n7\n8\n10\n11\n-1\n");
+  for (i = 0; i < 40; i++)
+  {
+    snprintf(command, sizeof(command), "create name p%d as %d", i, (i * 17) % 61 + 1);
+    CHECK(Status(domoS, command) == DomoS::OK);
+  }
+  for (i = 0; i < 40; i += 3)
+  {
+    snprintf(command, sizeof(command), "delete p%d", i);
+    CHECK(Status(domoS, command) == DomoS::OK);
+  }
+  before = List(domoS);
+  delete domoS;
+  memcpy(image, EEPROM.cell, sizeof(image));
+
+  //How many writings compact needs
+  writes = EEPROM.writes;
+  domoS = Boot("");
+  CHECK(Status(domoS, "compact") == DomoS::OK);
+  writes = EEPROM.writes - writes;
+  CHECK(List(domoS) == before);
+  printf("PowerCut: compact wrote %ld cells for %d peripherals\n", writes, (int)before.size());
+  delete domoS;
+  CHECK(writes > 0);
+
+  damaged = 0;
+  for (cut = 0; cut < writes; cut++)
+  {
+    memcpy(EEPROM.cell, image, sizeof(image));
+    domoS = Boot("");
+    EEPROM.powerCut = cut;
+    try
+    {
+      Run(domoS, "compact", 5000);
+    }
+    catch (ShimPowerCut &)
+    {
+    }
+    delete domoS;
+
+    domoS = Boot("");
+    if (List(domoS) != before)
+      damaged++;
+    delete domoS;
+  }
+  CHECK(damaged == 0);
+  if (damaged > 0)
+    printf("PowerCut: %d of %ld power cuts damaged the table\n", damaged, writes);
+
+  return;
+}
+
+static byte Crc8(const byte data[], size_t length)
+/*	The CRC-8 of the frames (polynomial x^8 + x^2 + x + 1)
+ */
+{
+  byte crc;
+  int i;
+
+  crc = 0;
+  for (; length > 0; length--, data++)
+  {
+    crc ^= *data;
+    for (i = 0; i < 8; i++)
+      crc = (crc & 0x80) ? ((crc << 1) ^ 0x07) : (crc << 1);
+  }
+
+  return crc;
+}
+
+static void TestDamagedVersion()
+/*	A damaged version cell must not make the file look older and be migrated: the CRC of the
+ 	header proves it's the current version, so the version is written again
+ */
+{
+  static const int FILEVER = 2; //The cell of the version of the file
+  static const byte DAMAGED[] = { 0, 1, 3, 0xFF };
+
+  DomoS* domoS;
+  std::multiset<std::string> before;
+  size_t i;
+
+  domoS = FirstStart(SETUP);
+  CHECK(Status(domoS, "create name lamp as 5") == DomoS::OK);
+  CHECK(Status(domoS, "create name fan as 3") == DomoS::OK);
+  before = List(domoS);
+  delete domoS;
+  CHECK(before.size() == 2);
+
+  for (i = 0; i < sizeof(DAMAGED); i++)
+  {
+    EEPROM.cell[FILEVER] = DAMAGED[i];
+    domoS = Boot("");
+    CHECK(List(domoS) == before);
+    Run(domoS, "", 100);
+    CHECK(EEPROM.cell[FILEVER] == 4);
+    delete domoS;
+  }
+
+  return;
+}
+
+static void TestMigrateVersion0()
+/*	A file of version 0 is migrated even if the cell E2END, where the first DomoS left 0, has by
+ 	chance the CRC of its header whit the current version
+ */
+{
+  static const byte HEADER[] = { 168, 63, 0, 18, 8, 2, 3, 4, 5, 7, 8, 9, 10, 6, 255 }; //18 peripherals, 8 address pins
+  static const int OLDRECORDSIZE = 11; //The slots of version 0: the name and the number
+
+  DomoS* domoS;
+  byte header[sizeof(HEADER) - 2];
+  int i;
+
+  ShimClearEeprom(0);
+  memcpy(EEPROM.cell, HEADER, sizeof(HEADER));
+  for (i = 0; i < 18; i++)
+  {
+    snprintf((char*)&EEPROM.cell[sizeof(HEADER) + (OLDRECORDSIZE * i)], OLDRECORDSIZE - 1, "p%d", i);
+    EEPROM.cell[sizeof(HEADER) + (OLDRECORDSIZE * i) + OLDRECORDSIZE - 1] = i + 1;
+  }
+  memcpy(header, HEADER + 2, sizeof(header));
+  header[0] = 4;
+  EEPROM.cell[E2END] = Crc8(header, sizeof(header));
+
+  domoS = Boot("");
+  CHECK(domoS->IsOn());
+  CHECK(Stat(domoS, "peripherals") == 18);
+  CHECK(Status(domoS, "turn p3 high") == DomoS::OK);
+  CHECK(Status(domoS, "turn #4 low") == DomoS::OK);
+  CHECK(EEPROM.cell[2] == 4);
+  delete domoS;
+
+  return;
+}
+
+static void TestMigrateNames()
+/*	Migrating a file of version 1 the character not allowed become '_', a name that becomes the
+ 	same of another one takes the standard name and it's printed
+ */
+{
+  static const byte HEADER[] = { 168, 63, 1, 4, 3, 2, 3, 4, 255, 255, 255, 255, 255, 6, 255 }; //4 peripherals, 3 address pins
+  static const char* const NAME[] = { "lamp", "a,b", "a%b", "fan" };
+  static const int OLDRECORDSIZE = 11; //The slots of version 1: the name and the number
+
+  DomoS* domoS;
+  std::string output;
+  int i;
+
+  ShimClearEeprom(0);
+  memcpy(EEPROM.cell, HEADER, sizeof(HEADER));
+  for (i = 0; i < 4; i++)
+  {
+    snprintf((char*)&EEPROM.cell[sizeof(HEADER) + (OLDRECORDSIZE * i)], OLDRECORDSIZE - 1, "%s", NAME[i]);
+    EEPROM.cell[sizeof(HEADER) + (OLDRECORDSIZE * i) + OLDRECORDSIZE - 1] = i + 1;
+  }
+
+  ShimPowerOn();
+  domoS = new DomoS();
+  output = ShimTakeOutput();
+  CHECK(output.find("its number as name: 3") != std::string::npos);
+  CHECK(Stat(domoS, "peripherals") == 4);
+  CHECK(Status(domoS, "turn lamp high") == DomoS::OK);
+  CHECK(Status(domoS, "turn a_b high") == DomoS::OK);
+  CHECK(Status(domoS, "turn 3 high") == DomoS::OK);
+  CHECK(Status(domoS, "turn fan high") == DomoS::OK);
+  CHECK(Status(domoS, "delete a_b") == DomoS::OK);
+  CHECK(Status(domoS, "turn #2 high") == DomoS::PERIPHERALNOTFOUND); //Only one had the name
+  CHECK(Status(domoS, "turn #3 high") == DomoS::OK);
+  CHECK(EEPROM.cell[2] == 4);
+  delete domoS;
+
+  return;
+}
+
+static void TestAddressPinsWithoutPort()
+/*	A pin without a port can't be an address pin: the first start asks it again, and a header
+ 	whit such a pin is taken as damaged, so the configuration is asked again
+ */
+{
+  static const int HEADER = 2; //The first cell of the header
+  static const int ADDRESSPIN = 5; //The cell of the first address pin
+
+  DomoS* domoS;
+  std::string output;
+  byte header[13];
+  size_t event;
+
+  //Pin 25 doesn't exist on an Arduino Uno
+  ShimClearEeprom(0xFF);
+  ShimPowerOn();
+  ShimInput("1\n0\n3\n2\n25\n3\n4\n-1\n");
+  domoS = new DomoS();
+  output = ShimTakeOutput();
+  CHECK(output.find("Error! Reinsert") != std::string::npos);
+  CHECK(EEPROM.cell[ADDRESSPIN + 1] == 3);
+  CHECK(Status(domoS, "create name lamp as 5") == DomoS::OK);
+  ShimPinLog.clear();
+  CHECK(Status(domoS, "turn lamp high") == DomoS::OK);
+  for (event = 0; (event < ShimPinLog.size()) && (ShimPinLog[event].pin != ShimPortPin + PD); event++);
+  CHECK((event < ShimPinLog.size()) && (ShimPinLog[event].value == ((1 << 2) | (1 << 4)))); //5 (101) on the pins 2, 3, 4
+  delete domoS;
+
+  //A header whit the right CRC but a pin without a port
+  EEPROM.cell[ADDRESSPIN + 1] = 25;
+  memcpy(header, &EEPROM.cell[HEADER], sizeof(header));
+  EEPROM.cell[E2END] = Crc8(header, sizeof(header));
+  ShimPowerOn();
+  ShimInput("1\n0\n3\n2\n3\n4\n-1\n");
+  domoS = new DomoS();
+  output = ShimTakeOutput();
+  CHECK(output.find("The configuration is damaged") != std::string::npos);
+  CHECK(EEPROM.cell[ADDRESSPIN + 1] == 3);
+  CHECK(Stat(domoS, "peripherals") == 1); //The peripherals are kept
+  CHECK(Status(domoS, "turn lamp high") == DomoS::OK);
+  delete domoS;
+
+  return;
+}
+
+static void TestWearSpreading()
+/*	Deleting and creating again the same peripherals must go on writing the slots after the
+ 	last used one, so every cell of the table is written about as much as the others
+ */
+{
+  DomoS* domoS;
+  char command[STRINGLEN];
+  unsigned long most;
+  int i;
+
+  domoS = FirstStart("1\n0\n6\n2\n4\n7\n8\n10\n11\n-1\n");
+  for (i = 0; i < 10; i++)
+  {
+    snprintf(command, sizeof(command), "create name p%d", i);
+    CHECK(Status(domoS, command) == DomoS::OK);
+  }
+
+  //About three times all the 126 slots
+  for (i = 0; i < 350; i++)
+  {
+    snprintf(command, sizeof(command), "delete p%d", i % 10);
+    CHECK(Status(domoS, command) == DomoS::OK);
+    snprintf(command, sizeof(command), "create name p%d", i % 10);
+    CHECK(Status(domoS, command) == DomoS::OK);
+  }
+  CHECK(Stat(domoS, "peripherals") == 10);
+  delete domoS;
+
+  //The cells of the table, a cell of the number map is written whenever its peripheral moves
+  most = 0;
+  for (i = 0; (i <= E2END) && (i < NUMBERMAP); i++)
+    if (EEPROM.cellWrites[i] > most)
+      most = EEPROM.cellWrites[i];
+  CHECK(most <= 12);
+  printf("WearSpreading: the most written cell was written %lu times\n", most);
+
+  return;
+}
+
+static void TestFullTableWrites()
+/*	On a full table a deleted slot is reused by the next create, so a delete only frees its
+ 	slot instead of starting a compaction that rewrites the whole table, and a delete and a
+ 	create together write no more than a new slot
+ */
+{
+  DomoS* domoS;
+  char command[STRINGLEN];
+  unsigned long writes, most, both;
+  long capacity;
+  int i, n;
+
+  domoS = FirstStart("1\n0\n8\n2\n4\n7\n8\n10\n11\n12\n13\n-1\n");
+  capacity = Stat(domoS, "capacity");
+  if (capacity > 255) //The address pins can't handle more than 255 peripherals
+    capacity = 255;
+  for (i = 0; i < capacity; i++)
+  {
+    snprintf(command, sizeof(command), "create name p%d", i);
+    CHECK(Status(domoS, command) == DomoS::OK);
+  }
+  CHECK(Stat(domoS, "peripherals") == capacity);
+
+  most = 0;
+  both = 0;
+  for (i = 0; i < 50; i++)
+  {
+    n = (i * 37) % capacity; //Spread the holes over the table
+    snprintf(command, sizeof(command), "delete p%d", n);
+    writes = EEPROM.writes;
+    CHECK(Status(domoS, command) == DomoS::OK);
+    if (EEPROM.writes - writes > most)
+      most = EEPROM.writes - writes;
+    snprintf(command, sizeof(command), "create name p%d", n);
+    CHECK(Status(domoS, command) == DomoS::OK);
+    if (EEPROM.writes - writes > both)
+      both = EEPROM.writes - writes;
+  }
+  CHECK(Stat(domoS, "peripherals") == capacity);
+  CHECK(most <= 2);
+  CHECK(both <= 12); //At most the 8 cells of a slot and the number map, about what a create wrote before the slots
+  printf("FullTableWrites: a delete wrote at most %lu cells, a delete and a create %lu\n", most, both);
+  delete domoS;
+
+  return;
+}
+
+static void TestCompactMoves()
+/*	Compact moves every peripheral directly in its place: the numbers 2, 3, 4, 5, 1 are a
+ 	single chain closed on itself, so only one peripheral is moved twice, 6 moves in all
+ 	Every move writes the number in the new slot and clears it in the old one
+ */
+{
+  DomoS* domoS;
+  char command[STRINGLEN];
+  unsigned long numberWrites;
+  int i;
+
+  domoS = FirstStart("1\n0\n6\n2\n4\n7\n8\n10\n11\n-1\n");
+  for (i = 0; i < 5; i++)
+  {
+    snprintf(command, sizeof(command), "create as %d", (i + 1) % 5 + 1);
+    CHECK(Status(domoS, command) == DomoS::OK);
+  }
+
+  numberWrites = 0;
+  for (i = 0; i < 126; i++)
+    numberWrites -= EEPROM.cellWrites[FIRSTSLOT + SLOTSIZE * i + SLOTSIZE - 1];
+  CHECK(Status(domoS, "compact") == DomoS::OK);
+  for (i = 0; i < 126; i++)
+    numberWrites += EEPROM.cellWrites[FIRSTSLOT + SLOTSIZE * i + SLOTSIZE - 1];
+  CHECK(numberWrites == 2 * 6);
+
+  //Sorted and compact
+  for (i = 0; i < 5; i++)
+    CHECK(EEPROM.cell[FIRSTSLOT + SLOTSIZE * i + SLOTSIZE - 1] == i + 1);
+  delete domoS;
+
+  return;
+}
+
+static unsigned long CheckNumbers(DomoS* domoS, const bool used[])
+/*	Turn every number on: the used ones must be found and the others not
+ 	Return the most EEPROM reads of finding a peripheral
+ */
+{
+  char command[STRINGLEN];
+  unsigned long reads, most;
+  int number;
+
+  most = 0;
+  for (number = 1; number < 256; number++)
+  {
+    snprintf(command, sizeof(command), "turn #%d high", number);
+    reads = EEPROM.reads;
+    CHECK(Status(domoS, command) == (used[number] ? DomoS::OK : DomoS::PERIPHERALNOTFOUND));
+    if (used[number] && (EEPROM.reads - reads > most))
+      most = EEPROM.reads - reads;
+  }
+
+  return most;
+}
+
+static void TestNumberMap()
+/*	A peripheral is found by number after creates out of order, deletes and a compaction; whit
+ 	the number map every lookup reads only its cell and the number of the slot, and a wrong map
+ 	is still checked against the slot and rebuilt at the next start
+ */
+{
+  DomoS* domoS;
+  char command[STRINGLEN];
+  bool used[256] = {};
+  unsigned long single, most;
+  int i, number, slot;
+
+  domoS = FirstStart("1\n0\n8\n2\n4\n7\n8\n10\n11\n12\n13\n-1\n");
+  CHECK(Status(domoS, "create name first as 1") == DomoS::OK);
+  used[1] = true;
+  single = CheckNumbers(domoS, used);
+
+  //Numbers out of order, then a third of them deleted
+  for (i = 1; i < 60; i++)
+  {
+    number = (i * 7) % 251 + 1;
+    snprintf(command, sizeof(command), "create name p%d as %d", number, number);
+    CHECK(Status(domoS, command) == DomoS::OK);
+    used[number] = true;
+  }
+  for (i = 1; i < 60; i += 3)
+  {
+    number = (i * 7) % 251 + 1;
+    snprintf(command, sizeof(command), "delete p%d", number);
+    CHECK(Status(domoS, command) == DomoS::OK);
+    used[number] = false;
+  }
+  most = CheckNumbers(domoS, used);
+  if (HASNUMBERMAP)
+    CHECK(most == single);
+
+  CHECK(Status(domoS, "compact") == DomoS::OK);
+  most = CheckNumbers(domoS, used);
+  if (HASNUMBERMAP)
+    CHECK(most == single);
+
+  if (HASNUMBERMAP)
+  {
+    //Every number points to the first slot, the lookups check the slot and search the table
+    for (number = 0; number < 256; number++)
+      EEPROM.cell[NUMBERMAP + number] = 0;
+    CheckNumbers(domoS, used);
+
+    //At the next start the map is right again
+    delete domoS;
+    domoS = Boot("");
+    Run(domoS, "", 100); //Idle, the fixed cells are written
+    for (number = 1; number < 256; number++)
+    {
+      slot = EEPROM.cell[NUMBERMAP + number];
+      if (used[number])
+        CHECK((slot < 255) && (EEPROM.cell[FIRSTSLOT + SLOTSIZE * slot + SLOTSIZE - 1] == number));
+      else
+        CHECK(slot == 255);
+    }
+    CHECK(CheckNumbers(domoS, used) == single);
+  }
+  delete domoS;
+
+  return;
+}
+
+static int FrameStatus(DomoS* domoS, const byte fields[], byte length)
+/*	Send a binary frame whit length bytes of opcode, id and fields, and return the status of the
+ 	answer, -1 if it didn't answer
+ */
+{
+  std::vector<byte> frame;
+  std::string output;
+  size_t answer;
+  size_t i;
+
+  frame.push_back(length);
+  frame.insert(frame.end(), fields, fields + length);
+  frame.push_back(Crc8(&frame[0], frame.size()));
+
+  Serial.input.push_back(0xA5);
+  for (i = 0; i < frame.size(); i++)
+    Serial.input.push_back(frame[i]);
+  output = Run(domoS, "", 100);
+
+  answer = output.find((char)0xA5);
+
+  return ((answer != std::string::npos) && (answer + 3 < output.size())) ? (byte)output[answer + 3] : -1;
+}
+
+static void TestWipeRefusesFrames()
+/*	While reset wipe clears the storage, and after it, the binary frames must be refused like the
+ 	text commands, or they would write the storage again
+ */
+{
+  static const byte CREATE[] = { 0, 7, 0, 0, 'l', 'a', 'm', 'p' }; //Opcode, id, first free number, channel 0, name
+  static const byte DELETE[] = { 2, 8, 1 }; //Opcode, id, number 1
+
+  DomoS* domoS;
+  int i;
+  boolean wiped;
+
+  domoS = FirstStart(SETUP);
+  CHECK(FrameStatus(domoS, CREATE, sizeof(CREATE)) == DomoS::OK);
+
+  ShimInput("reset wipe\n");
+  domoS->Work();
+  CHECK(FrameStatus(domoS, DELETE, sizeof(DELETE)) == DomoS::WIPEINPROGRESS);
+
+  Run(domoS, "", E2END + 1000); //The end of the wipe, a cell every millisecond
+  CHECK(FrameStatus(domoS, CREATE, sizeof(CREATE)) == DomoS::WIPEINPROGRESS);
+  Run(domoS, "", 100);
+
+  wiped = true;
+  for (i = 0; i <= E2END; i++)
+    wiped = wiped && (EEPROM.cell[i] == 0);
+  CHECK(wiped);
+  delete domoS;
+
+  return;
+}
+
+static std::string ImportLine(const std::vector<byte> & records)
+/*	Build an import command for the stored records, whit their CRC
+ */
+{
+  std::string line;
+  char hex[3];
+  size_t i;
+
+  line = "import ";
+  for (i = 0; i < records.size(); i++)
+  {
+    snprintf(hex, sizeof(hex), "%02x", records[i]);
+    line += hex;
+  }
+  snprintf(hex, sizeof(hex), "%02x", Crc8(&records[0], records.size()));
+  line += hex;
+
+  return line;
+}
+
+static void TestImportChecks()
+/*	An imported record must pass the same checks of create: the number must fit the address
+ 	pins, the peripherals of the line can't exceed the maximum and the name can't start whit #
+ */
+{
+  static const size_t RECORDSIZE = 8; //7 cells of name, then the number
+  static const byte HASHCODE = 45; //The code of # in a packed name, its position in the charset plus one
+
+  DomoS* domoS;
+  std::vector<byte> exported, records;
+  std::string output;
+  size_t start;
+  char hex[3] = { 0, 0, 0 };
+  char command[STRINGLEN];
+  int i;
+
+  //The records of a, b and big, numbered 7, 8 and 9 by a board whit 6 address pins
+  domoS = FirstStart("1\n0\n6\n2\n4\n7\n8\n10\n11\n-1\n");
+  CHECK(Status(domoS, "create name a as 7") == DomoS::OK);
+  CHECK(Status(domoS, "create name b as 8") == DomoS::OK);
+  CHECK(Status(domoS, "create name big as 9") == DomoS::OK);
+  output = Run(domoS, "export", 1);
+  delete domoS;
+  start = output.find("import ") + 7;
+  for (i = 0; i < 3 * (int)RECORDSIZE; i++)
+  {
+    hex[0] = output[start + 2 * i];
+    hex[1] = output[start + 2 * i + 1];
+    exported.push_back((byte)strtol(hex, NULL, 16));
+  }
+
+  //3 address pins, up to 7 peripherals, 6 already there
+  domoS = FirstStart(SETUP);
+  for (i = 0; i < 6; i++)
+  {
+    snprintf(command, sizeof(command), "create name p%d", i);
+    CHECK(Status(domoS, command) == DomoS::OK);
+  }
+
+  //a fits, b is the 8th peripheral
+  records.assign(exported.begin(), exported.begin() + 2 * RECORDSIZE);
+  CHECK(Status(domoS, ImportLine(records).c_str()) == DomoS::PERIPHERALMAXIMUMNUMBERREACH);
+
+  CHECK(Status(domoS, "delete p0") == DomoS::OK);
+  records.assign(exported.begin() + 2 * RECORDSIZE, exported.end());
+  CHECK(Status(domoS, ImportLine(records).c_str()) == DomoS::DECIMALNUMBERTOOBIG);
+
+  //a renamed #
+  records.assign(exported.begin(), exported.begin() + RECORDSIZE);
+  records[0] = (HASHCODE << 2) | (records[0] & 3);
+  CHECK(Status(domoS, ImportLine(records).c_str()) == DomoS::NAMEINVALIDCHARACTER);
+
+  records.assign(exported.begin(), exported.begin() + RECORDSIZE);
+  CHECK(Status(domoS, ImportLine(records).c_str()) == DomoS::OK);
+  CHECK(Stat(domoS, "peripherals") == 6);
+  delete domoS;
+
+  return;
+}
+
+//To add a test add a row here
+static const struct
+{
+  const char* name;
+  void (*test)();
+} TEST[] = {
+  { "CreateTurnDelete", TestCreateTurnDelete },
+  { "Restart", TestRestart },
+  { "LookupReads", TestLookupReads },
+  { "AddressPorts", TestAddressPorts },
+  { "ShiftRegister", TestShiftRegister },
+  { "BootLatency", TestBootLatency },
+  { "ChannelOverlap", TestChannelOverlap },
+  { "TurnValues", TestTurnValues },
+  { "ExitEndsTurns", TestExitEndsTurns },
+  { "PowerCut", TestPowerCut },
+  { "DamagedVersion", TestDamagedVersion },
+  { "MigrateVersion0", TestMigrateVersion0 },
+  { "MigrateNames", TestMigrateNames },
+  { "AddressPinsWithoutPort", TestAddressPinsWithoutPort },
+  { "WearSpreading", TestWearSpreading },
+  { "FullTableWrites", TestFullTableWrites },
+  { "CompactMoves", TestCompactMoves },
+  { "NumberMap", TestNumberMap },
+  { "WipeRefusesFrames", TestWipeRefusesFrames },
+  { "ImportChecks", TestImportChecks }
+};
+
+int main()
+{
+  size_t i;
+  int before;
+
+  for (i = 0; i < sizeof(TEST) / sizeof(TEST[0]); i++)
+  {
+    before = failures;
+    TEST[i].test();
+    printf("%s %s\n", (failures == before) ? "PASS" : "FAIL", TEST[i].name);
+  }
+
+  return (failures == 0) ? 0 : 1;
+}
@@ -0,0 +1,124 @@
+#ifndef Arduino_H
+
+#define Arduino_H
+/*
+ The part of the Arduino core used by DomoS, for building it on a computer
+ The time is virtual: it goes ahead only whit delay or when a test calls ShimAdvance
+ The pins, the ports and the serial port are recorded, so the tests can check them
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <string>
+#include <deque>
+#include <vector>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#ifndef E2END
+#define E2END 1023 //The last EEPROM cell, change it whit -DE2END for the other boards
+#endif
+
+//There's no flash memory, the tables stay in the RAM
+#define PROGMEM
+#define pgm_read_byte(address) (*(const byte*)(address))
+#define pgm_read_ptr(address) (*(void* const*)(address))
+#define memcpy_P memcpy
+#define memcmp_P memcmp
+#define strchr_P strchr
+
+class __FlashStringHelper;
+#define F(text) ((const __FlashStringHelper*)(text))
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+
+//The SPI pins of an Arduino Uno
+#define MOSI 11
+#define MISO 12
+#define SCK 13
+
+//Time
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+
+//Pins, every writing is recorded in ShimPinLog
+void pinMode(byte pin, byte mode);
+void digitalWrite(byte pin, byte value);
+void analogWrite(byte pin, int value);
+
+/*
+ The ports of an Arduino Uno: pins 0-7 are port D, 8-13 port B, 14-19 port C
+ DomoS writes the ports directly whit the interrupts disabled, so every time SREG is restored
+ the ports are recorded
+ */
+static const byte NOT_A_PORT = 0;
+static const byte PB = 2;
+static const byte PC = 3;
+static const byte PD = 4;
+
+byte digitalPinToPort(byte pin);
+byte digitalPinToBitMask(byte pin);
+volatile byte* portOutputRegister(byte port);
+
+class ShimStatusRegister
+{
+public:
+  ShimStatusRegister & operator=(byte value); //Records the ports
+  operator byte() const;
+
+private:
+  byte _value;
+};
+
+extern ShimStatusRegister SREG;
+void cli();
+void sei();
+
+long map(long value, long fromLow, long fromHigh, long toLow, long toHigh);
+char* itoa(int value, char text[], int base);
+
+/*
+ The serial port, the input is written by the tests and the output is kept until taken
+ */
+class HardwareSerial
+{
+public:
+  void begin(long baud);
+  void end();
+  void flush();
+  int available();
+  int read();
+  long parseInt();
+
+  size_t write(byte value);
+  size_t write(const byte data[], size_t length);
+
+  size_t print(const __FlashStringHelper* text);
+  size_t print(const char text[]);
+  size_t print(char value);
+  size_t print(unsigned char value);
+  size_t print(int value);
+  size_t print(unsigned int value);
+  size_t print(long value);
+  size_t print(unsigned long value);
+  size_t print(double value);
+
+  template <class T> size_t println(T value)
+  {
+    return print(value) + println();
+  }
+  size_t println();
+
+  std::deque<byte> input; //The bytes not read yet
+  std::string output; //All the bytes written
+};
+
+extern HardwareSerial Serial;
+
+#endif
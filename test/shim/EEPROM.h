@@ -0,0 +1,33 @@
+#ifndef EEPROM_H
+
+#define EEPROM_H
+#include <Arduino.h>
+
+/*
+ The EEPROM of the board, E2END + 1 cells counting the accesses and the writings of every cell
+ A power cut can be set after a number of writings: the writing that would exceed it throws
+ ShimPowerCut without changing the cell
+ */
+struct ShimPowerCut
+{
+};
+
+class EEPROMClass
+{
+public:
+  EEPROMClass();
+
+  byte read(int address);
+  void write(int address, byte value);
+  void update(int address, byte value);
+
+  byte cell[E2END + 1]; //The content of the EEPROM
+  unsigned long reads; //Number of cells read
+  unsigned long writes; //Number of cells written
+  unsigned long cellWrites[E2END + 1]; //Number of writings of every cell
+  long powerCut; //Number of writings still allowed, -1 for no power cut
+};
+
+extern EEPROMClass EEPROM;
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef SPI_H
+
+#define SPI_H
+#include <Arduino.h>
+
+#define MSBFIRST 1
+#define SPI_MODE0 0
+
+class SPISettings
+{
+public:
+  SPISettings(unsigned long clock, byte bitOrder, byte dataMode);
+};
+
+/*
+ The SPI bus, every byte transferred is recorded in ShimPinLog whit pin ShimSpiPin
+ */
+class SPIClass
+{
+public:
+  void begin();
+  void beginTransaction(SPISettings settings);
+  void endTransaction();
+  byte transfer(byte value);
+};
+
+extern SPIClass SPI;
+
+#endif
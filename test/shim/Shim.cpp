@@ -0,0 +1,390 @@
+#include <Arduino.h>
+#include <EEPROM.h>
+#include <SPI.h>
+#include "Shim.h"
+#include <stdio.h>
+
+HardwareSerial Serial;
+EEPROMClass EEPROM;
+SPIClass SPI;
+ShimStatusRegister SREG;
+
+std::vector<ShimPinEvent> ShimPinLog;
+byte ShimPort[PD + 1];
+unsigned long ShimDelayTime;
+
+static unsigned long ShimTime; //Virtual microseconds since ShimPowerOn
+
+//The RAM not initialized at startup, DomoS puts there its snapshot (.noinit on the board)
+extern char __start_domos_noinit[] __attribute__((weak));
+extern char __stop_domos_noinit[] __attribute__((weak));
+
+static void Record(int pin, int value, boolean analog)
+{
+  ShimPinEvent event;
+
+  event.time = ShimTime / 1000;
+  event.pin = pin;
+  event.value = value;
+  event.analog = analog;
+  ShimPinLog.push_back(event);
+}
+
+void ShimPowerOn()
+{
+  ShimReset();
+
+  //At power on the RAM has any value
+  if ((__start_domos_noinit != NULL) && (__stop_domos_noinit != NULL))
+    memset(__start_domos_noinit, 0x5A, __stop_domos_noinit - __start_domos_noinit);
+}
+
+void ShimReset()
+{
+  ShimTime = 0;
+  ShimDelayTime = 0;
+  ShimPinLog.clear();
+  memset(ShimPort, 0, sizeof(ShimPort));
+  Serial.input.clear();
+  Serial.output.clear();
+  EEPROM.powerCut = -1;
+}
+
+void ShimAdvance(unsigned long ms)
+{
+  ShimTime += ms * 1000;
+}
+
+void ShimInput(const char text[])
+{
+  for (; *text != '\0'; text++)
+    Serial.input.push_back((byte)*text);
+}
+
+std::string ShimTakeOutput()
+{
+  std::string output;
+
+  output.swap(Serial.output);
+
+  return output;
+}
+
+void ShimClearEeprom(byte value)
+{
+  memset(EEPROM.cell, value, sizeof(EEPROM.cell));
+  memset(EEPROM.cellWrites, 0, sizeof(EEPROM.cellWrites));
+  EEPROM.reads = 0;
+  EEPROM.writes = 0;
+}
+
+//Time
+unsigned long millis()
+{
+  return ShimTime / 1000;
+}
+
+unsigned long micros()
+{
+  return ShimTime;
+}
+
+void delay(unsigned long ms)
+{
+  ShimDelayTime += ms;
+  ShimAdvance(ms);
+}
+
+//Pins
+void pinMode(byte pin, byte mode)
+{
+  (void)pin;
+  (void)mode;
+}
+
+void digitalWrite(byte pin, byte value)
+{
+  Record(pin, value, false);
+}
+
+void analogWrite(byte pin, int value)
+{
+  Record(pin, value, true);
+}
+
+byte digitalPinToPort(byte pin)
+{
+  byte port;
+
+  if (pin < 8)
+    port = PD;
+  else if (pin < 14)
+    port = PB;
+  else if (pin < 20)
+    port = PC;
+  else
+    port = NOT_A_PORT;
+
+  return port;
+}
+
+byte digitalPinToBitMask(byte pin)
+{
+  byte mask;
+
+  if (pin < 8)
+    mask = 1 << pin;
+  else if (pin < 14)
+    mask = 1 << (pin - 8);
+  else
+    mask = 1 << ((pin - 14) % 8);
+
+  return mask;
+}
+
+volatile byte* portOutputRegister(byte port)
+{
+  return &ShimPort[port];
+}
+
+ShimStatusRegister & ShimStatusRegister::operator=(byte value)
+{
+  byte port;
+
+  _value = value;
+  for (port = PB; port <= PD; port++)
+    Record(ShimPortPin + port, ShimPort[port], false);
+
+  return *this;
+}
+
+ShimStatusRegister::operator byte() const
+{
+  return _value;
+}
+
+void cli()
+{
+}
+
+void sei()
+{
+}
+
+long map(long value, long fromLow, long fromHigh, long toLow, long toHigh)
+{
+  return (value - fromLow) * (toHigh - toLow) / (fromHigh - fromLow) + toLow;
+}
+
+char* itoa(int value, char text[], int base)
+{
+  char digit[8 * sizeof(int) + 1];
+  unsigned int number;
+  int i, j;
+
+  number = ((value < 0) && (base == 10)) ? -value : value;
+  i = 0;
+  do
+  {
+    digit[i] = "0123456789abcdefghijklmnopqrstuvwxyz"[number % base];
+    number /= base;
+    i++;
+  }
+  while (number > 0);
+
+  j = 0;
+  if ((value < 0) && (base == 10))
+    text[j++] = '-';
+  while (i > 0)
+    text[j++] = digit[--i];
+  text[j] = '\0';
+
+  return text;
+}
+
+//Serial port
+void HardwareSerial::begin(long baud)
+{
+  (void)baud;
+}
+
+void HardwareSerial::end()
+{
+}
+
+void HardwareSerial::flush()
+{
+}
+
+int HardwareSerial::available()
+{
+  return input.size();
+}
+
+int HardwareSerial::read()
+{
+  int value;
+
+  value = -1;
+  if (!input.empty())
+  {
+    value = input.front();
+    input.pop_front();
+  }
+
+  return value;
+}
+
+long HardwareSerial::parseInt()
+/*	As the Arduino one: skip everything before the number, stop at the first character after it
+ */
+{
+  long value;
+  boolean negative;
+
+  while ((!input.empty()) && (!isdigit(input.front())) && (input.front() != '-'))
+    input.pop_front();
+
+  negative = ((!input.empty()) && (input.front() == '-'));
+  if (negative)
+    input.pop_front();
+
+  value = 0;
+  while ((!input.empty()) && (isdigit(input.front())))
+  {
+    value = value * 10 + input.front() - '0';
+    input.pop_front();
+  }
+
+  return negative ? -value : value;
+}
+
+size_t HardwareSerial::write(byte value)
+{
+  output += (char)value;
+
+  return 1;
+}
+
+size_t HardwareSerial::write(const byte data[], size_t length)
+{
+  output.append((const char*)data, length);
+
+  return length;
+}
+
+size_t HardwareSerial::print(const __FlashStringHelper* text)
+{
+  return print((const char*)text);
+}
+
+size_t HardwareSerial::print(const char text[])
+{
+  output += text;
+
+  return strlen(text);
+}
+
+size_t HardwareSerial::print(char value)
+{
+  return write((byte)value);
+}
+
+size_t HardwareSerial::print(unsigned char value)
+{
+  return print((unsigned long)value);
+}
+
+size_t HardwareSerial::print(int value)
+{
+  return print((long)value);
+}
+
+size_t HardwareSerial::print(unsigned int value)
+{
+  return print((unsigned long)value);
+}
+
+size_t HardwareSerial::print(long value)
+{
+  return print(std::to_string(value).c_str());
+}
+
+size_t HardwareSerial::print(unsigned long value)
+{
+  return print(std::to_string(value).c_str());
+}
+
+size_t HardwareSerial::print(double value)
+{
+  char text[32];
+
+  snprintf(text, sizeof(text), "%.2f", value);
+
+  return print(text);
+}
+
+size_t HardwareSerial::println()
+{
+  return print("\r\n");
+}
+
+//EEPROM
+EEPROMClass::EEPROMClass()
+{
+  ShimClearEeprom(0xFF); //A new EEPROM
+  powerCut = -1;
+}
+
+byte EEPROMClass::read(int address)
+{
+  reads++;
+
+  return cell[address];
+}
+
+void EEPROMClass::write(int address, byte value)
+{
+  if (powerCut == 0)
+    throw ShimPowerCut();
+  if (powerCut > 0)
+    powerCut--;
+
+  writes++;
+  cellWrites[address]++;
+  cell[address] = value;
+}
+
+void EEPROMClass::update(int address, byte value)
+{
+  if (cell[address] != value)
+    write(address, value);
+}
+
+//SPI
+SPISettings::SPISettings(unsigned long clock, byte bitOrder, byte dataMode)
+{
+  (void)clock;
+  (void)bitOrder;
+  (void)dataMode;
+}
+
+void SPIClass::begin()
+{
+}
+
+void SPIClass::beginTransaction(SPISettings settings)
+{
+  (void)settings;
+}
+
+void SPIClass::endTransaction()
+{
+}
+
+byte SPIClass::transfer(byte value)
+{
+  Record(ShimSpiPin, value, false);
+
+  return 0;
+}
@@ -0,0 +1,34 @@
+#ifndef Shim_H
+
+#define Shim_H
+#include <Arduino.h>
+#include <EEPROM.h>
+
+/*
+ What the tests can do on the simulated board
+ */
+
+//A writing on a pin, a port or the SPI bus
+struct ShimPinEvent
+{
+  unsigned long time; //Virtual milliseconds
+  int pin; //The pin, ShimPortPin + port for a port or ShimSpiPin
+  int value;
+  boolean analog; //True for analogWrite
+};
+
+static const int ShimPortPin = 100; //The pin of the events of the ports
+static const int ShimSpiPin = 200; //The pin of the events of the SPI bus
+
+extern std::vector<ShimPinEvent> ShimPinLog; //All the writings since ShimPowerOn
+extern byte ShimPort[PD + 1]; //The output registers of the ports
+extern unsigned long ShimDelayTime; //Virtual milliseconds spent in delay
+
+void ShimPowerOn(); //Starts the board again, the EEPROM is kept and the RAM not initialized is lost
+void ShimReset(); //Starts the board again by the reset button, the EEPROM and the RAM not initialized are kept
+void ShimAdvance(unsigned long ms); //Lets the virtual time go ahead
+void ShimInput(const char text[]); //Sends text on the serial port
+std::string ShimTakeOutput(); //Gets and clears what was printed on the serial port
+void ShimClearEeprom(byte value); //Fills the EEPROM and clears the counters
+
+#endif